@@ -22,4 +22,132 @@ build)
 clean)
     rm -rf ./build
     ;;
+bench)
+    # All microbenchmarks as JSON lines, e.g. ./dev.sh bench > before.jsonl
+    gzg="${2:-./build/gzg}"
+    for n in 2 8 32 256; do
+        for size in 1920x1080 3840x2160; do
+            "$gzg" --bench draw --synthetic "$n" --size "$size"
+            "$gzg" --bench wedge_fill --synthetic "$n" --size "$size"
+        done
+    done
+    for size in 1920x1080 3840x2160; do
+        "$gzg" --bench bg_effects --size "$size"
+    done
+    for b in fit_font_size sector_index_from_point distance_to_rect_edge \
+        screenshot_convert screenshot_dim utf8_decode stdin; do
+        "$gzg" --bench "$b"
+    done
+    ;;
+golden)
+    # Rewrite tests/golden/*.png from the current renderer. Only after an
+    # intentional rendering change; review the new images before committing.
+    gzg="${2:-./build/gzg}"
+    for png in tests/golden/n*-*x*-h*.png; do
+        name=$(basename "$png" .png)
+        flags=
+        case "$name" in
+            *-rings) flags=--rings; name=${name%-rings} ;;
+            *-compact) flags=--compact; name=${name%-compact} ;;
+        esac
+        n=${name%%-*}
+        n=${n#n}
+        size=${name#*-}
+        size=${size%-h*}
+        hover=${name##*-h}
+        "$gzg" --render-png "$png" --entries-file "tests/golden/blank-$n.txt" \
+            --size "$size" --hover "$hover" $flags
+        echo "$png"
+    done
+    ;;
+replay)
+    # Replay every trace in tests/replay; prints the summary JSON line of each.
+    gzg="${2:-./build/gzg}"
+    for log in tests/replay/*.log; do
+        "$gzg" --replay "$log" | tail -n 1
+    done
+    ;;
+replay-synth)
+    # Rewrite the synthetic traces in tests/replay: scripted sweeps, keys, a
+    # resize and a click at fixed 60/120 Hz spacing. They are not --record
+    # sessions; they only exercise the replay path deterministically.
+    synth() {
+        awk -v W="$2" -v H="$3" -v rings="$4" -v loops="$5" -v names="$6" -v n="$7" '
+        function ev(s) { print t " " s }
+        BEGIN {
+            pi = atan2(0, -1)
+            print "gzg-record 1"
+            print "# synthetic: ./dev.sh replay-synth, not a --record session"
+            print "size " W " " H
+            print "rings " rings
+            print "compact 0"
+            if (names != "") {
+                n = split(names, e, ",")
+                for (i = 1; i <= n; ++i) print "entry " e[i]
+            } else {
+                for (i = 1; i <= n; ++i) print "entry Entry " i
+            }
+            t = 0
+            cx = int(W / 2); cy = int(H / 2)
+            # Approach from the centre, then circle at 120 Hz
+            for (i = 1; i < 20; ++i) { t += 16667; ev("motion " cx + i * 10 " " cy) }
+            r = (W < H ? W : H) * 0.35
+            for (i = 0; i < int(loops * 240); ++i) {
+                t += 8333
+                a = i / 240 * 2 * pi
+                rr = rings ? r * (0.6 + 0.4 * sin(i / 37)) : r
+                ev("motion " int(cx + rr * cos(a)) " " int(cy + rr * sin(a)))
+            }
+            # Keyboard navigation
+            split("0xff09 0xff09 0xff53 0xff51 0xff52 0xff54 0xff09", k, " ")
+            for (i = 1; i <= 7; ++i) { t += 120000; ev("key " k[i]) }
+            # The WM resizes the window
+            t += 50000
+            W = int(W * 4 / 5); H = int(H * 5 / 6)
+            ev("configure " W " " H)
+            cx = int(W / 2); cy = int(H / 2)
+            for (i = 0; i < 60; ++i) {
+                t += 16667
+                a = i / 60 * pi
+                ev("motion " int(cx + r * 0.7 * cos(a)) " " int(cy + r * 0.7 * sin(a)))
+            }
+            t += 90000
+            ev("press 1 " int(cx + r * 0.7 * cos(pi)) " " cy)
+        }' >"$1"
+        echo "$1"
+    }
+    synth tests/replay/sweep-n8-1280x720.log 1280 720 0 2 \
+        Terminal,Browser,Editor,Files,Mail,Music,Calculator,Settings 8
+    synth tests/replay/sweep-n256-rings-1920x1080.log 1920 1080 1 3 "" 256
+    ;;
+bench-type)
+    # Typing throughput/correctness of --type under Xvfb for several XKB
+    # layouts. Needs Xvfb and setxkbmap. Prints one JSON line per run.
+    gzg="${2:-./build/gzg}"
+    disp=":${BENCH_DISPLAY:-97}"
+    Xvfb "$disp" -screen 0 1280x800x24 -nolisten tcp >/dev/null 2>&1 &
+    xvfb_pid=$!
+    trap 'kill "$xvfb_pid" 2>/dev/null' EXIT
+    for _ in $(seq 50); do
+        DISPLAY="$disp" setxkbmap -query >/dev/null 2>&1 && break
+        sleep 0.1
+    done
+
+    for layout in us de fr us,ru; do
+        DISPLAY="$disp" setxkbmap -layout "$layout" -option '' -option grp:alt_shift_toggle
+        for corpus in ascii latin1 cjk emoji cyrillic; do
+            log=$(mktemp)
+            DISPLAY="$disp" "$gzg" --bench-type-receiver "$corpus" >"$log" &
+            receiver_pid=$!
+            for _ in $(seq 100); do
+                grep -q '^# ready' "$log" && break
+                sleep 0.05
+            done
+            DISPLAY="$disp" "$gzg" --bench-type "$corpus" | sed "s/^{/{\"layout\":\"$layout\",/"
+            wait "$receiver_pid" || true
+            grep -v '^#' "$log" | sed "s/^{/{\"layout\":\"$layout\",/"
+            rm -f "$log"
+        done
+    done
+    ;;
 esac
@@ -8,6 +8,7 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xproto.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/xtest.h>
@@ -16,17 +17,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <poll.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <xcb/xkb.h>
+#include <xcb/composite.h>
+#include <xcb/randr.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 1024
@@ -48,10 +61,41 @@
 #define XK_space     0x0020
 #define XK_Shift_L   0xffe1
 #define XK_Control_L 0xffe3
+#define XK_Alt_L     0xffe9
+#define XK_Super_L   0xffeb
+#define XK_Insert    0xff63
 
 // Typing behavior
-#define TYPE_DELAY_MS         200   // sleep after close before typing
+#define TYPE_FOCUS_TIMEOUT_MS 200   // max wait for focus to return before typing
+#define TYPE_FOCUS_POLL_MS    5     // GetInputFocus poll interval while waiting
 #define TYPE_EVENT_DELAY_US   1000  // small delay between fake inputs
+#define TYPE_REMAP_MAX_KEYS   64    // spare keycodes used for unmapped chars
+#define TYPE_REMAP_SETTLE_MS  10    // let clients refetch the keymap
+
+// Paste behavior
+#define PASTE_DEFAULT_CHORD   "ctrl+v"
+#define PASTE_TIMEOUT_MS      3000  // give up serving the selection after this
+#define PASTE_MAX_CHUNK       (256 * 1024)  // INCR chunk size upper bound
+#define PASTE_MAX_INCR        4     // concurrent INCR transfers
+
+// Rendering quality
+#define LOWBW_PRESENT_MS      100   // a slower blit switches to low-bandwidth mode
+#define EXPOSE_MAX_RECTS      32    // beyond this, damage is merged into a bounding box
+#define COMPACT_DEFAULT_RADIUS 320  // --compact window radius in pixels
+#define GRAB_RETRY_MS         1000  // keep retrying grabs a key binding still holds
+#define GRAB_RETRY_POLL_MS    1
+
+// Frosted background (--frosted)
+#define FROST_SCALE           4     // blur resolution divisor (the SSE2 fast paths need 4)
+#define FROST_RADIUS_PX       24    // box radius per pass, in screen pixels
+#define FROST_PASSES          3     // box passes; three come close to a Gaussian
+#define FROST_DIM             0.40  // screenshot darkening, frosted or not
+#define FROST_MAX_THREADS     8
+
+// Marking-menu behavior
+#define MARK_DEAD_ZONE_PX     12    // shorter strokes have no direction
+#define MARK_COMMIT_FRAC      0.25  // crossing this fraction of the short side selects
+#define MARK_DWELL_MS         300   // pause before the full menu is drawn
 
 // --- Debug helper -------------------------------------------------------
 static int dbg_enabled(void)
@@ -72,8 +116,163 @@ static int dbg_enabled(void)
 typedef struct
 {
 	char *text;
+	char *icon_path;           // optional, after a TAB on the input line
+	cairo_surface_t *icon;     // pre-scaled thumbnail, see load_icons()
 } Entry;
 
+// QUALITY_LOW is for remote displays: everything is drawn on the server
+// with opaque fills and no per-frame image uploads.
+enum { QUALITY_FULL, QUALITY_LOW };
+
+// Everything a frame depends on, independent of the target surface.
+typedef struct
+{
+	int width, height;
+	cairo_surface_t *bg_image;  // optional, scaled to fill
+	int bg_w, bg_h;
+	int bg_on_server;           // bg_image is a server pixmap (kept at low quality)
+	const Entry *entries;
+	int n;
+	int hover_idx;
+	int rings;                  // 0 = one wedge per entry, else concentric rings
+	int low_quality;            // opaque fills, no client background, shadows or icons
+	int compact;                // pie clipped to the inscribed disc
+	const atomic_uint_fast64_t *live_gen;  // optional: abandon once this moves past gen
+	uint64_t gen;
+} Scene;
+
+// Reverse keymap index: (keysym, group) -> (keycode, level).
+// Open addressing with linear probing; kc == 0 marks an empty slot.
+#define KEYIDX_CORE_TYPE 0xFF      // slot built from the core keymap
+
+typedef struct
+{
+	xcb_keysym_t sym;
+	uint8_t group;
+	uint8_t level;
+	uint8_t kt;                // XKB key type index, or KEYIDX_CORE_TYPE
+	xcb_keycode_t kc;
+} KeyIndexSlot;
+
+typedef struct
+{
+	KeyIndexSlot *slots;
+	uint32_t mask;             // capacity - 1 (capacity is a power of two)
+	int valid;                 // cleared on MappingNotify
+	int n_groups;              // groups present in the keymap
+	xcb_keycode_t mod_kc[8];   // keycode that sets each real modifier
+} KeyIndex;
+
+// XKB keymap as far as typing needs it: key types (levels and the
+// modifiers selecting them), per-key symbols and the modifier map.
+#define XKB_MAX_TYPE_ENTRIES 32
+
+typedef struct
+{
+	uint8_t mods;              // effective modifier mask selecting the level
+	uint8_t level;
+} XkbTypeEntry;
+
+typedef struct
+{
+	uint8_t mask;              // modifiers the type looks at
+	uint8_t num_levels;
+	uint8_t n_entries;
+	XkbTypeEntry entries[XKB_MAX_TYPE_ENTRIES];
+} XkbKeyType;
+
+typedef struct
+{
+	uint32_t sym_off;          // first keysym in XkbKeyMap.syms
+	uint16_t n_syms;
+	uint8_t n_groups;
+	uint8_t group_info;        // out-of-range group handling (XKB groupInfo)
+	uint8_t width;             // keysyms per group
+	uint8_t kt[4];             // key type per group
+} XkbKey;
+
+typedef struct
+{
+	XkbKeyType *types;
+	int n_types;
+	xcb_keysym_t *syms;
+	XkbKey keys[256];
+	uint8_t modmap[256];
+	int n_groups;              // highest group count of any key
+	int valid;
+} XkbKeyMap;
+
+// Keycodes with no symbols in the server keymap. Characters missing from
+// the layout are bound to them temporarily while typing.
+typedef struct
+{
+	xcb_keycode_t kc[TYPE_REMAP_MAX_KEYS];
+	xcb_keysym_t sym[TYPE_REMAP_MAX_KEYS];  // currently bound keysym, 0 = none
+	int n;
+	int probed;
+	int dirty;                              // bindings to undo on restore
+	int pressed;                            // keys sent on them since the last settle
+} SpareKeys;
+
+// Log-linear latency histogram (HdrHistogram style): exact below 16us,
+// then 16 linear buckets per power of two, i.e. ~6% relative precision.
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (28 * HIST_SUB)  // values up to ~2^31 us
+
+typedef struct
+{
+	uint32_t counts[HIST_BUCKETS];
+	uint64_t n;
+	int64_t min_us, max_us;
+} Histogram;
+
+typedef struct
+{
+	int enabled;                // --stats
+	int overlay;                // --stats-overlay
+	int64_t event_ns;           // arrival of the input shown by the frame being drawn, 0 = none
+	int64_t last_render_ns;     // duration of the most recent draw
+	Histogram latency;          // input arrival -> end of blit
+	Histogram render;           // draw() duration
+	Histogram complete;         // input arrival -> server has executed the blit
+	int complete_pending;       // GetInputFocus sent after a blit, reply not seen yet
+	unsigned int complete_seq;
+	int64_t complete_event_ns;
+} FrameStats;
+
+// Rendering runs on its own thread so input, selection and the timeout
+// never wait behind a slow frame. The event loop only posts the latest
+// state; every post that changes what is on screen bumps gen, and a frame
+// rendered for an older gen is abandoned part way and never presented.
+typedef struct
+{
+	pthread_t thread;
+	pthread_mutex_t lock;       // guards the request fields and App.stats
+	pthread_cond_t wake;
+	int running;                // thread started; posts are handled synchronously otherwise
+	atomic_uint_fast64_t gen;   // latest request, polled by render_scene
+	uint64_t cur_gen;           // gen of the frame being drawn (render thread only)
+	Entry *entries;
+	int n;
+
+	// Pending request, taken as a whole by the render thread
+	int quit;
+	int frame;                  // a new frame is wanted
+	int hover_idx;
+	int64_t event_ns;           // stats: oldest input not yet on screen, 0 = none
+	int resize_w, resize_h;     // new window size, 0 = unchanged
+	xcb_rectangle_t damage[EXPOSE_MAX_RECTS];
+	int n_damage;
+} Renderer;
+
+typedef struct
+{
+	int enabled;               // blur, dim and desaturate the screenshot
+	double desaturate;         // 0 = keep colours, 1 = greyscale
+	int threads;               // 0 = one per online CPU (at most FROST_MAX_THREADS)
+} FrostOpts;
+
 typedef struct
 {
 	xcb_connection_t *conn;
@@ -97,10 +296,32 @@ typedef struct
 	// Background screenshot (optional)
 	cairo_surface_t *bg_image;
 	int bg_w, bg_h;
+	xcb_pixmap_t bg_pixmap;    // server-side capture backing bg_image
+	FrostOpts frost;           // client-side screenshot treatment
+	int server_side;           // back buffer and background live on the server
+	int rings;                 // ring layout (see ring_count_for), 0 = wedges
+	int x, y;                  // window origin on the root (override-redirect)
+	int compact;               // small window around the pointer
+	int quality;               // QUALITY_*
+	int auto_quality;          // may still drop to QUALITY_LOW on a slow frame
 
 	// Keyboard layout awareness
 	uint8_t active_group;
+	uint8_t locked_group;      // group lock found at session start
+	uint8_t locked_mods;       // e.g. Caps Lock, affects level selection
+	int group_locked;          // we changed the group lock while typing
 	int xkb_available;
+	XkbKeyMap xkbmap;
+	KeyIndex keyidx;
+	SpareKeys spare;
+	int type_remap;            // bind unmapped chars to spare keycodes
+	uint64_t fake_events;      // XTEST events sent (for benchmarks)
+
+	xcb_window_t focus_before; // focus to restore if took_focus
+	int took_focus;            // -or fallback when the keyboard grab failed
+
+	FrameStats stats;
+	Renderer render;
 } App;
 
 static void sleep_ms(int ms)
@@ -127,6 +348,219 @@ static int64_t monotonic_ns(void)
 	return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
 }
 
+// --- Tracing -------------------------------------------------------------
+// Spans are kept in a fixed ring buffer (no formatting while running) and
+// written as Chrome/Perfetto trace JSON at exit to the path in $GZG_TRACE.
+// Span names must be string literals.
+#define TRACE_RING_SIZE 4096  // power of two; oldest spans are overwritten
+
+typedef struct
+{
+	const char *name;
+	int64_t start_ns;
+	int64_t dur_ns;
+	int tid;
+} TraceSpan;
+
+enum { TRACE_TID_MAIN = 1, TRACE_TID_RENDER };
+static _Thread_local int t_trace_tid = TRACE_TID_MAIN;
+
+static struct
+{
+	TraceSpan spans[TRACE_RING_SIZE];
+	atomic_uint_fast64_t n;
+	int enabled;
+	const char *path;
+	int64_t origin_ns;
+} g_trace;
+
+static void trace_dump(void)
+{
+	if (!g_trace.enabled) return;
+	g_trace.enabled = 0;
+	FILE *f = fopen(g_trace.path, "w");
+	if (!f) {
+		fprintf(stderr, "gzg: cannot write trace to %s: %s\n", g_trace.path, strerror(errno));
+		return;
+	}
+	uint64_t first = g_trace.n > TRACE_RING_SIZE ? g_trace.n - TRACE_RING_SIZE : 0;
+	int pid = (int)getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,\"args\":{\"name\":\"gzg\"}}", pid);
+	fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"render\"}}",
+	        pid, TRACE_TID_RENDER);
+	for (uint64_t i = first; i < g_trace.n; ++i) {
+		const TraceSpan *s = &g_trace.spans[i & (TRACE_RING_SIZE - 1)];
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+		        s->name, pid, s->tid, (double)(s->start_ns - g_trace.origin_ns) / 1e3, (double)s->dur_ns / 1e3);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+static void trace_init(void)
+{
+	const char *p = getenv("GZG_TRACE");
+	if (!p || !*p) return;
+	g_trace.path = p;
+	g_trace.origin_ns = monotonic_ns();
+	g_trace.enabled = 1;
+	atexit(trace_dump);
+}
+
+static int64_t trace_begin(void)
+{
+	return g_trace.enabled ? monotonic_ns() : 0;
+}
+
+static void trace_end(const char *name, int64_t start_ns)
+{
+	if (!g_trace.enabled) return;
+	TraceSpan *s = &g_trace.spans[atomic_fetch_add(&g_trace.n, 1) & (TRACE_RING_SIZE - 1)];
+	s->name = name;
+	s->tid = t_trace_tid;
+	s->start_ns = start_ns;
+	s->dur_ns = monotonic_ns() - start_ns;
+}
+
+// --- Protocol traffic accounting ------------------------------------------
+// Per-phase X traffic and memory, written as JSON at exit to the path in
+// $GZG_XSTATS ("-" for stderr). Requests are counted from sequence numbers
+// (a NoOperation marks each phase boundary); round trips and reply bytes
+// from the replies we wait on; screenshot and frame upload bytes
+// explicitly. Request bytes are an estimate: uploads plus 16 bytes for
+// every other request.
+#define XSTATS_MAX_PHASES 32
+#define XSTATS_REQ_BYTES  16
+
+typedef struct
+{
+	const char *name;
+	int64_t start_ns, dur_ns;
+	unsigned int seq0;
+	uint64_t requests;
+	uint64_t round_trips;
+	uint64_t reply_bytes;
+	uint64_t image_bytes;      // screenshot pixels received
+	uint64_t upload_bytes;     // frame pixels sent
+	long peak_rss_kb;          // sampled at the end of the phase
+} XPhase;
+
+static struct
+{
+	XPhase phases[XSTATS_MAX_PHASES];
+	int n;
+	int open;                  // phases[n - 1] is still accumulating
+	int enabled;
+	const char *path;
+	const char *backend;       // how frames and screenshots are produced
+} g_xstats;
+
+static XPhase *xstats_cur(void)
+{
+	return (g_xstats.enabled && g_xstats.open) ? &g_xstats.phases[g_xstats.n - 1] : NULL;
+}
+
+static long peak_rss_kb(void)
+{
+	struct rusage ru;
+	return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+}
+
+// Close the current phase and start `name` (NULL just closes). conn may be
+// NULL before connecting; request counts are then left at zero.
+static void xstats_phase(xcb_connection_t *conn, const char *name)
+{
+	if (!g_xstats.enabled) return;
+	unsigned int seq = conn ? xcb_no_operation(conn).sequence : 0;
+	XPhase *p = xstats_cur();
+	if (p) {
+		p->dur_ns = monotonic_ns() - p->start_ns;
+		if (conn && p->seq0) p->requests = seq - p->seq0 - 1;
+		p->peak_rss_kb = peak_rss_kb();
+		g_xstats.open = 0;
+	}
+	if (!name || g_xstats.n == XSTATS_MAX_PHASES) return;
+	p = &g_xstats.phases[g_xstats.n++];
+	memset(p, 0, sizeof(*p));
+	p->name = name;
+	p->start_ns = monotonic_ns();
+	p->seq0 = seq;
+	g_xstats.open = 1;
+}
+
+// Wrap a reply call: xstats_reply(xcb_foo_reply(...)).
+static void *xstats_reply(void *reply)
+{
+	XPhase *p = xstats_cur();
+	if (p && reply) {
+		p->round_trips++;
+		p->reply_bytes += 32 + 4 * (uint64_t)((xcb_generic_reply_t *)reply)->length;
+	}
+	return reply;
+}
+
+static void xstats_image(uint64_t bytes)
+{
+	XPhase *p = xstats_cur();
+	if (p) p->image_bytes += bytes;
+}
+
+static void xstats_upload(uint64_t bytes)
+{
+	XPhase *p = xstats_cur();
+	if (p) p->upload_bytes += bytes;
+}
+
+static void xstats_dump(void)
+{
+	if (!g_xstats.enabled) return;
+	g_xstats.enabled = 0;
+	int to_stderr = !strcmp(g_xstats.path, "-");
+	FILE *f = to_stderr ? stderr : fopen(g_xstats.path, "w");
+	if (!f) {
+		fprintf(stderr, "gzg: cannot write stats to %s: %s\n", g_xstats.path, strerror(errno));
+		return;
+	}
+	XPhase tot = {0};
+	fprintf(f, "{\"backend\":\"%s\",\"phases\":[", g_xstats.backend ? g_xstats.backend : "");
+	for (int i = 0; i < g_xstats.n; ++i) {
+		const XPhase *p = &g_xstats.phases[i];
+		uint64_t req_bytes = p->upload_bytes + XSTATS_REQ_BYTES * p->requests;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ms\":%.3f,\"requests\":%llu,\"round_trips\":%llu,"
+		        "\"request_bytes_est\":%llu,\"reply_bytes\":%llu,\"image_bytes\":%llu,"
+		        "\"upload_bytes\":%llu,\"peak_rss_kb\":%ld}",
+		        i ? "," : "", p->name, (double)p->dur_ns / 1e6, (unsigned long long)p->requests,
+		        (unsigned long long)p->round_trips, (unsigned long long)req_bytes,
+		        (unsigned long long)p->reply_bytes, (unsigned long long)p->image_bytes,
+		        (unsigned long long)p->upload_bytes, p->peak_rss_kb);
+		tot.dur_ns += p->dur_ns;
+		tot.requests += p->requests;
+		tot.round_trips += p->round_trips;
+		tot.reply_bytes += p->reply_bytes;
+		tot.image_bytes += p->image_bytes;
+		tot.upload_bytes += p->upload_bytes;
+	}
+	fprintf(f, "\n],\"total\":{\"ms\":%.3f,\"requests\":%llu,\"round_trips\":%llu,"
+	        "\"request_bytes_est\":%llu,\"reply_bytes\":%llu,\"image_bytes\":%llu,"
+	        "\"upload_bytes\":%llu,\"peak_rss_kb\":%ld}}\n",
+	        (double)tot.dur_ns / 1e6, (unsigned long long)tot.requests, (unsigned long long)tot.round_trips,
+	        (unsigned long long)(tot.upload_bytes + XSTATS_REQ_BYTES * tot.requests),
+	        (unsigned long long)tot.reply_bytes, (unsigned long long)tot.image_bytes,
+	        (unsigned long long)tot.upload_bytes, peak_rss_kb());
+	if (!to_stderr) fclose(f);
+}
+
+static void xstats_init(void)
+{
+	const char *p = getenv("GZG_XSTATS");
+	if (!p || !*p) return;
+	g_xstats.path = p;
+	g_xstats.backend = "cairo-image";
+	g_xstats.enabled = 1;
+	atexit(xstats_dump);
+}
+
 // --- Single-instance lock helpers ---------------------------------------
 static void sanitize_display(const char *in, char *out, size_t outsz)
 {
@@ -191,7 +625,7 @@ static xcb_visualtype_t *find_visualtype(const xcb_screen_t *screen, xcb_visuali
 static xcb_atom_t intern_atom(xcb_connection_t *c, const char *name, int only_if_exists)
 {
 	xcb_intern_atom_cookie_t ck = xcb_intern_atom(c, only_if_exists, strlen(name), name);
-	xcb_intern_atom_reply_t *r = xcb_intern_atom_reply(c, ck, NULL);
+	xcb_intern_atom_reply_t *r = xstats_reply(xcb_intern_atom_reply(c, ck, NULL));
 	if (!r) return XCB_NONE;
 	xcb_atom_t a = r->atom;
 	free(r);
@@ -270,17 +704,74 @@ static double distance_to_rect_edge(int W, int H, double cx, double cy, double a
 	return t;
 }
 
-static int sector_index_from_point(int n, int W, int H, int x, int y)
+// --- Ring layout ---------------------------------------------------------
+// Entries are spread over concentric rings of equal thickness inside the
+// largest centered circle; the outer ring extends to the window corners.
+// Ring k (0 = center disc) gets a share of the entries proportional to its
+// circumference, 2k + 1. That makes the first index of ring k simply
+// n * k^2 / rings^2, so layout and hit testing need no tables.
+#define RING_CELL_ASPECT 2.5       // target cell width / ring thickness
+
+static int ring_count_for(int n)
+{
+	// Cells are about pi * R * rings / n wide and R / rings thick.
+	int rings = (int)lround(sqrt(RING_CELL_ASPECT * n / M_PI));
+	if (rings < 1) rings = 1;
+	while (rings > 1 && rings * rings > n) --rings;  // every ring needs an entry
+	return rings;
+}
+
+static int ring_first(int n, int rings, int k)
+{
+	int64_t d = (int64_t)rings * rings;
+	return (int)(((int64_t)n * k * k + d / 2) / d);
+}
+
+static double ring_thickness(int rings, int W, int H)
+{
+	return fmax(1.0, 0.5 * fmin(W, H) / rings);
+}
+
+static int sector_index_from_point(int n, int rings, int W, int H, int x, int y)
 {
 	if (n <= 0) return -1;
 	double cx = W * 0.5, cy = H * 0.5;
 	double ang = atan2((double)y - cy, (double)x - cx);
 	if (ang < 0) ang += 2.0 * M_PI;
+	int first = 0;
+	if (rings > 1) {
+		int k = (int)(hypot((double)x - cx, (double)y - cy) / ring_thickness(rings, W, H));
+		if (k >= rings) k = rings - 1;
+		first = ring_first(n, rings, k);
+		n = ring_first(n, rings, k + 1) - first;
+	}
 	double step = (2.0 * M_PI) / (double)n;
 	int idx = (int)floor(ang / step);
 	if (idx < 0) idx = 0;
 	if (idx >= n) idx = n - 1;
-	return idx;
+	return first + idx;
+}
+
+// Marking menu: the wedge a stroke from (ox, oy) to (x, y) points at, by
+// direction alone. -1 while the stroke is inside the dead zone.
+static int mark_index(int n, int ox, int oy, int x, int y)
+{
+	int dx = x - ox, dy = y - oy;
+	if (dx * dx + dy * dy < MARK_DEAD_ZONE_PX * MARK_DEAD_ZONE_PX) return -1;
+	return sector_index_from_point(n, 0, 0, 0, dx, dy);
+}
+
+// Keyboard navigation: the selection after sym, or sel when sym does not
+// move it. Shared by the event loop and --replay.
+static int nav_apply(xcb_keysym_t sym, int sel, int n)
+{
+	if (n <= 0) return sel;
+	if (sel < 0) sel = 0;
+	if (sym == XK_Left || sym == XK_Up || sym == 'h' || sym == 'k' || sym == 'H' || sym == 'K')
+		return (sel - 1 + n) % n;
+	if (sym == XK_Right || sym == XK_Down || sym == 'l' || sym == 'j' || sym == 'L' || sym == 'J')
+		return (sel + 1) % n;
+	return sel;
 }
 
 static double fit_font_size(cairo_t *cr, const char *text, double maxw, double maxh)
@@ -302,603 +793,4330 @@ static double fit_font_size(cairo_t *cr, const char *text, double maxw, double m
 	return lo;
 }
 
-static void draw(App *app, Entry *entries, int n, int hover_idx)
+// --- Frame statistics ----------------------------------------------------
+static int hist_index(int64_t v)
 {
-	int W = app->width, H = app->height;
-	double cx = W * 0.5, cy = H * 0.5;
+	if (v < 0) v = 0;
+	if (v < HIST_SUB) return (int)v;
+	int msb = 63 - __builtin_clzll((unsigned long long)v);
+	int shift = msb - HIST_SUB_BITS;
+	int idx = (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
 
-	cairo_t *cr = app->bufcr;          // draw into back buffer
-	cairo_save(cr);
+// Highest value that lands in bucket idx.
+static int64_t hist_bucket_high(int idx)
+{
+	if (idx < HIST_SUB) return idx;
+	int shift = idx / HIST_SUB - 1;
+	int64_t low = (int64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+	return low + ((int64_t)1 << shift) - 1;
+}
 
-	// Background: screenshot if available, else solid
-	if (app->bg_image) {
-		cairo_save(cr);
-		double sx = (double)W / (double)app->bg_w;
-		double sy = (double)H / (double)app->bg_h;
-		cairo_scale(cr, sx, sy);
-		cairo_set_source_surface(cr, app->bg_image, 0, 0);
-		cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
-		cairo_paint(cr);
-		cairo_restore(cr);
-	} else {
-		cairo_set_source_rgb(cr, 0.08, 0.08, 0.10);
-		cairo_rectangle(cr, 0, 0, W, H);
-		cairo_fill(cr);
-	}
+static void hist_record(Histogram *h, int64_t us)
+{
+	if (us < 0) us = 0;
+	h->counts[hist_index(us)]++;
+	if (!h->n || us < h->min_us) h->min_us = us;
+	if (us > h->max_us) h->max_us = us;
+	h->n++;
+}
 
-	if (n <= 0) {
-		cairo_set_source_rgb(cr, 0.9, 0.2, 0.2);
-		cairo_select_font_face(cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-		double s = fmin(W, H) * 0.08;
-		cairo_set_font_size(cr, s);
-		const char *msg = "No entries.";
-		cairo_text_extents_t ext;
-		cairo_text_extents(cr, msg, &ext);
-		cairo_move_to(cr, cx - (ext.width * 0.5 + ext.x_bearing), cy - (ext.height * 0.5 + ext.y_bearing));
-		cairo_show_text(cr, msg);
-		cairo_restore(cr);
+static int64_t hist_percentile(const Histogram *h, double pct)
+{
+	if (!h->n) return 0;
+	uint64_t want = (uint64_t)ceil(pct / 100.0 * (double)h->n);
+	if (want < 1) want = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->counts[i];
+		if (seen >= want) {
+			int64_t v = hist_bucket_high(i);
+			return v < h->max_us ? v : h->max_us;
+		}
+	}
+	return h->max_us;
+}
 
-		// Blit back buffer to the window in one go
-		cairo_set_source_surface(app->cr, app->bufsurf, 0, 0);
-		cairo_set_operator(app->cr, CAIRO_OPERATOR_SOURCE);
-		cairo_paint(app->cr);
-		cairo_surface_flush(app->csurf);
-		xcb_flush(app->conn);
+static void hist_print(FILE *f, const char *name, const Histogram *h)
+{
+	if (!h->n) {
+		fprintf(f, "  %-18s n=0\n", name);
 		return;
 	}
+	fprintf(f, "  %-18s n=%-6llu min=%.2fms p50=%.2fms p90=%.2fms p99=%.2fms p99.9=%.2fms max=%.2fms\n",
+	        name, (unsigned long long)h->n, (double)h->min_us / 1e3,
+	        (double)hist_percentile(h, 50.0) / 1e3, (double)hist_percentile(h, 90.0) / 1e3,
+	        (double)hist_percentile(h, 99.0) / 1e3, (double)hist_percentile(h, 99.9) / 1e3,
+	        (double)h->max_us / 1e3);
+}
 
-	double step = (2.0 * M_PI) / (double)n;
-	// Big radius so the arc is outside the window; ensures wedge fills to edges after clipping.
-	double R = hypot((double)W, (double)H);  // safely beyond all corners
-
-	for (int i = 0; i < n; ++i) {
-		double a0 = step * i;
-		double a1 = step * (i + 1);
-
-		// Fill wedge (semi-transparent over background)
-		double r, g, b;
-		double base_v = (i == hover_idx) ? 0.95 : 0.75;
-		hsv_to_rgb((double)i / (double)n, 0.55, base_v, &r, &g, &b);
-		// double alpha = (i == hover_idx) ? 0.80 : 0.55;
-		double alpha = (i == hover_idx) ? 0.50 : 0.40;
-		cairo_set_source_rgba(cr, r, g, b, alpha);
-
-		cairo_new_path(cr);
-		cairo_move_to(cr, cx, cy);
-		cairo_line_to(cr, cx + R * cos(a0), cy + R * sin(a0));
-		cairo_arc(cr, cx, cy, R, a0, a1);
-		cairo_close_path(cr);
-		cairo_fill(cr);
-
-		// Text: place at mid-angle, mid-radius
-		const char *txt = entries[i].text ? entries[i].text : "";
-		double amid = (a0 + a1) * 0.5;
-		double t_edge = distance_to_rect_edge(W, H, cx, cy, amid);
-		double rmid = fmax(10.0, t_edge * 0.5);
-		double px = cx + rmid * cos(amid);
-		double py = cy + rmid * sin(amid);
+// Called right after the blit has been queued, before the flush. Runs on
+// the render thread; the event loop polls for completion, hence the lock.
+static void stats_frame_done(App *app, int64_t start_ns)
+{
+	FrameStats *st = &app->stats;
+	int64_t end_ns = monotonic_ns();
+	pthread_mutex_lock(&app->render.lock);
+	st->last_render_ns = end_ns - start_ns;
+	hist_record(&st->render, st->last_render_ns / 1000);
+	if (st->event_ns) {
+		hist_record(&st->latency, (end_ns - st->event_ns) / 1000);
+		// The reply to a request sent after the blit means the server has
+		// executed it. Only one is kept in flight.
+		if (!st->complete_pending) {
+			st->complete_seq = xcb_get_input_focus(app->conn).sequence;
+			st->complete_event_ns = st->event_ns;
+			st->complete_pending = 1;
+		}
+		st->event_ns = 0;
+	}
+	pthread_mutex_unlock(&app->render.lock);
+}
 
-		// Available width approximated by distance between sector boundaries at rmid
-		double avail_w = fmax(20.0, 0.9 * 2.0 * rmid * sin(step * 0.5));
-		// And limited by distance to nearest window edge to avoid clipping
-		double dist_x = fmin(px, (double)W - px);
-		double dist_y = fmin(py, (double)H - py);
-		avail_w = fmin(avail_w, 1.8 * fmin(dist_x, dist_y));
-		double avail_h = fmin(avail_w, 0.6 * rmid);
+static void stats_poll_completion(App *app)
+{
+	FrameStats *st = &app->stats;
+	pthread_mutex_lock(&app->render.lock);
+	void *reply = NULL;
+	xcb_generic_error_t *err = NULL;
+	if (st->complete_pending && xcb_poll_for_reply(app->conn, st->complete_seq, &reply, &err)) {
+		hist_record(&st->complete, (monotonic_ns() - st->complete_event_ns) / 1000);
+		free(reply);
+		free(err);
+		st->complete_pending = 0;
+	}
+	pthread_mutex_unlock(&app->render.lock);
+}
 
-		cairo_select_font_face(cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-		double fs = fit_font_size(cr, txt, avail_w, avail_h);
-		cairo_set_font_size(cr, fs);
-		cairo_set_source_rgba(cr, 0.05, 0.05, 0.07, 0.9);  // drop shadow
-		cairo_text_extents_t ext;
-		cairo_text_extents(cr, txt, &ext);
-		double tx = px - (ext.width * 0.5 + ext.x_bearing);
-		double ty = py - (ext.height * 0.5 + ext.y_bearing);
-		cairo_move_to(cr, tx + 1.5, ty + 1.5);
-		cairo_show_text(cr, txt);
-		cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-		cairo_move_to(cr, tx, ty);
-		cairo_show_text(cr, txt);
+static void stats_report(App *app)
+{
+	FrameStats *st = &app->stats;
+	if (st->complete_pending) {
+		xcb_discard_reply(app->conn, st->complete_seq);
+		st->complete_pending = 0;
 	}
+	fprintf(stderr, "gzg stats:\n");
+	hist_print(stderr, "event-to-render", &st->latency);
+	hist_print(stderr, "event-to-complete", &st->complete);
+	hist_print(stderr, "render", &st->render);
+}
 
+// Last frame time and p99 latency in the top-left corner of the window,
+// never in the back buffer (Expose repairs reuse it). The box area is
+// restored from the back buffer first, so drawing it again does not
+// darken it.
+static void stats_draw_overlay(App *app, cairo_t *cr)
+{
+	const FrameStats *st = &app->stats;
+	char buf[96];
+	pthread_mutex_lock(&app->render.lock);
+	const Histogram *lat = st->complete.n ? &st->complete : &st->latency;
+	snprintf(buf, sizeof(buf), "frame %.2f ms  p99 %.2f ms  n=%llu",
+	         (double)st->last_render_ns / 1e6, (double)hist_percentile(lat, 99.0) / 1e3,
+	         (unsigned long long)lat->n);
+	pthread_mutex_unlock(&app->render.lock);
+
+	cairo_save(cr);
+	cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+	cairo_set_font_size(cr, 14.0);
+	cairo_text_extents_t ext;
+	cairo_text_extents(cr, buf, &ext);
+	cairo_rectangle(cr, 8, 8, ext.x_advance + 16, 26);
+	cairo_clip_preserve(cr);
+	cairo_set_source_surface(cr, app->bufsurf, 0, 0);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.7);
+	cairo_fill(cr);
+	cairo_set_source_rgb(cr, 0.6, 1.0, 0.6);
+	cairo_move_to(cr, 16, 26);
+	cairo_show_text(cr, buf);
 	cairo_restore(cr);
+}
 
-	// Blit back buffer to the window in one go (reduces artifacts)
+// Blit back buffer to the window in one go (reduces artifacts). Only a
+// blit that follows a render (rendered) counts as a frame for --stats.
+static void present_frame(App *app, int64_t start_ns, int rendered)
+{
 	cairo_set_source_surface(app->cr, app->bufsurf, 0, 0);
 	cairo_set_operator(app->cr, CAIRO_OPERATOR_SOURCE);
 	cairo_paint(app->cr);
+	if (app->stats.overlay) stats_draw_overlay(app, app->cr);
+	cairo_surface_flush(app->csurf);
+	if (!app->server_side) xstats_upload((uint64_t)app->width * (uint64_t)app->height * 4);
+	if (app->stats.enabled && rendered) stats_frame_done(app, start_ns);
+	xcb_flush(app->conn);
+}
 
+// Expose repair: copy just the damaged rectangles from the back buffer,
+// which always holds the latest frame.
+static void present_rects(App *app, const xcb_rectangle_t *rects, int n)
+{
+	uint64_t px = 0;
+	cairo_save(app->cr);
+	cairo_new_path(app->cr);
+	for (int i = 0; i < n; ++i) {
+		cairo_rectangle(app->cr, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		px += (uint64_t)rects[i].width * rects[i].height;
+	}
+	cairo_clip(app->cr);
+	cairo_set_source_surface(app->cr, app->bufsurf, 0, 0);
+	cairo_set_operator(app->cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(app->cr);
+	cairo_restore(app->cr);
+	if (app->stats.overlay) stats_draw_overlay(app, app->cr);
 	cairo_surface_flush(app->csurf);
+	if (!app->server_side) xstats_upload(px * 4);
 	xcb_flush(app->conn);
 }
 
-static void recreate_cairo(App *app)
+static void damage_add(xcb_rectangle_t *rects, int *n, int x, int y, int w, int h)
 {
-	if (app->cr) {
-		cairo_destroy(app->cr);
-		app->cr = NULL;
+	if (*n < EXPOSE_MAX_RECTS) {
+		rects[(*n)++] = (xcb_rectangle_t){(int16_t)x, (int16_t)y, (uint16_t)w, (uint16_t)h};
+		return;
 	}
-	if (app->csurf) {
-		cairo_surface_destroy(app->csurf);
-		app->csurf = NULL;
+	xcb_rectangle_t *b = &rects[*n - 1];
+	int x1 = b->x + b->width > x + w ? b->x + b->width : x + w;
+	int y1 = b->y + b->height > y + h ? b->y + b->height : y + h;
+	b->x = b->x < x ? b->x : (int16_t)x;
+	b->y = b->y < y ? b->y : (int16_t)y;
+	b->width = (uint16_t)(x1 - b->x);
+	b->height = (uint16_t)(y1 - b->y);
+}
+
+// Centered label with drop shadow, rotated by rot around (px, py). An icon
+// goes left of the text; unrotated and unscaled it lands on whole pixels so
+// it is a plain copy from the thumbnail.
+static void draw_label(cairo_t *cr, const char *txt, cairo_surface_t *icon, double px, double py, double rot,
+                       double avail_w, double avail_h, int shadow)
+{
+	double iw = 0.0, ih = 0.0, is = 1.0, gap = 0.0;
+	if (icon) {
+		iw = cairo_image_surface_get_width(icon);
+		ih = cairo_image_surface_get_height(icon);
+		is = fmin(1.0, fmin(avail_h / ih, 0.5 * avail_w / iw));
+		iw *= is;
+		ih *= is;
+		gap = 0.15 * ih;
+		avail_w = fmax(1.0, avail_w - iw - gap);
 	}
-	if (app->bufcr) {
-		cairo_destroy(app->bufcr);
-		app->bufcr = NULL;
+	cairo_select_font_face(cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+	double fs = fit_font_size(cr, txt, avail_w, avail_h);
+	cairo_set_font_size(cr, fs);
+	cairo_text_extents_t ext;
+	cairo_text_extents(cr, txt, &ext);
+	cairo_save(cr);
+	cairo_translate(cr, px, py);
+	if (rot != 0.0) cairo_rotate(cr, rot);
+	double left = -(iw + gap + ext.width) * 0.5;
+	if (icon) {
+		double ix = left, iy = -ih * 0.5;
+		if (rot == 0.0) {
+			ix = round(px + ix) - px;
+			iy = round(py + iy) - py;
+		}
+		cairo_save(cr);
+		cairo_translate(cr, ix, iy);
+		if (is != 1.0) cairo_scale(cr, is, is);
+		cairo_set_source_surface(cr, icon, 0, 0);
+		cairo_paint(cr);
+		cairo_restore(cr);
 	}
-	if (app->bufsurf) {
-		cairo_surface_destroy(app->bufsurf);
-		app->bufsurf = NULL;
+	double tx = left + iw + gap - ext.x_bearing;
+	double ty = -(ext.height * 0.5 + ext.y_bearing);
+	if (shadow) {
+		cairo_set_source_rgba(cr, 0.05, 0.05, 0.07, 0.9);  // drop shadow
+		cairo_move_to(cr, tx + 1.5, ty + 1.5);
+		cairo_show_text(cr, txt);
 	}
-	xcb_visualtype_t *vt = find_visualtype(app->screen, app->screen->root_visual);
-	app->csurf = cairo_xcb_surface_create(app->conn, app->win, vt, app->width, app->height);
-	app->cr = cairo_create(app->csurf);
-	cairo_set_antialias(app->cr, CAIRO_ANTIALIAS_FAST);
-
-	app->bufsurf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, app->width, app->height);
-	app->bufcr = cairo_create(app->bufsurf);
-	cairo_set_antialias(app->bufcr, CAIRO_ANTIALIAS_FAST);
-
-	DBG("[piewin] Recreated Cairo surfaces %dx%d (double-buffer)\n", app->width, app->height);
+	cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+	cairo_move_to(cr, tx, ty);
+	cairo_show_text(cr, txt);
+	cairo_restore(cr);
 }
 
-static void set_fullscreen_hint(App *app)
+// Compact mode clips the pie to the inscribed disc, kept a pixel inside so
+// its antialiased edge is not cut off by the window border.
+static double compact_disc_radius(int W, int H)
 {
-	// Set initial _NET_WM_STATE to FULLSCREEN before mapping (best-effort)
-	if (app->NET_WM_STATE != XCB_NONE && app->NET_WM_STATE_FULLSCREEN != XCB_NONE) {
-		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->NET_WM_STATE, XCB_ATOM_ATOM, 32, 1, &app->NET_WM_STATE_FULLSCREEN);
-	}
+	return fmax(1.0, 0.5 * fmin(W, H) - 1.0);
 }
 
-static void set_wm_delete_protocol(App *app)
+// Compact mode grabs the pointer without confining it to the window, so
+// clicks anywhere on screen arrive in window coordinates; outside the disc
+// they cancel instead of picking a wedge by angle.
+static int compact_outside(int W, int H, int x, int y)
 {
-	if (app->WM_PROTOCOLS != XCB_NONE && app->WM_DELETE_WINDOW != XCB_NONE) {
-		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->WM_PROTOCOLS, XCB_ATOM_ATOM, 32, 1, &app->WM_DELETE_WINDOW);
-	}
+	return hypot((double)x - W * 0.5, (double)y - H * 0.5) > compact_disc_radius(W, H);
 }
 
-static void set_window_title(App *app, const char *title)
+// Wedge colour at the given alpha; opaque mode pre-blends it over the solid
+// background so the server only has to fill.
+static void set_fill(cairo_t *cr, double r, double g, double b, double alpha, int opaque)
+{
+	if (opaque)
+		cairo_set_source_rgb(cr, r * alpha + 0.08 * (1.0 - alpha), g * alpha + 0.08 * (1.0 - alpha),
+		                     b * alpha + 0.10 * (1.0 - alpha));
+	else
+		cairo_set_source_rgba(cr, r, g, b, alpha);
+}
+
+// A newer request has been posted since this frame started (see Renderer).
+static int scene_superseded(const Scene *sc)
+{
+	return sc->live_gen && atomic_load_explicit(sc->live_gen, memory_order_relaxed) != sc->gen;
+}
+
+// Ring layout: geometry is computed once per ring, so label sizes depend on
+// the ring's cell size rather than on the total number of entries. Labels
+// follow the ring's tangent and are flipped on the lower half to stay upright.
+static int render_rings(cairo_t *cr, const Scene *sc)
+{
+	int W = sc->width, H = sc->height;
+	double cx = W * 0.5, cy = H * 0.5;
+	int n = sc->n, rings = sc->rings;
+	double dr = ring_thickness(rings, W, H);
+	// The outer ring reaches the corners, or the disc edge in compact mode
+	double R = sc->compact ? compact_disc_radius(W, H) : hypot((double)W, (double)H);
+
+	for (int k = 0; k < rings; ++k) {
+		int first = ring_first(n, rings, k);
+		int count = ring_first(n, rings, k + 1) - first;
+		double r0 = k * dr;
+		double r1 = (k == rings - 1) ? R : (k + 1) * dr;
+		double step = (2.0 * M_PI) / (double)count;
+		double rmid = (k == 0) ? 0.55 * dr : (k + 0.5) * dr;
+		double avail_w = fmax(20.0, 0.9 * 2.0 * rmid * sin(fmin(step, M_PI) * 0.5));
+		double avail_h = 0.7 * dr;
+		if (k == 0 && count == 1) {
+			avail_w = 1.6 * dr;
+			avail_h = 0.6 * dr;
+		}
+
+		for (int j = 0; j < count; ++j) {
+			if (scene_superseded(sc)) return 0;
+			int i = first + j;
+			double a0 = step * j;
+			double a1 = step * (j + 1);
+
+			// Alternate brightness so neighbours with close hues stay apart
+			double r, g, b;
+			double base_v = (i == sc->hover_idx) ? 0.95 : ((j + k) & 1) ? 0.65 : 0.75;
+			hsv_to_rgb((double)i / (double)n, 0.55, base_v, &r, &g, &b);
+			double alpha = (i == sc->hover_idx) ? 0.50 : 0.40;
+			set_fill(cr, r, g, b, alpha, sc->low_quality);
+
+			cairo_new_path(cr);
+			if (count == 1) {
+				cairo_arc(cr, cx, cy, r1, 0.0, 2.0 * M_PI);
+				if (k > 0) {
+					cairo_new_sub_path(cr);
+					cairo_arc_negative(cr, cx, cy, r0, 2.0 * M_PI, 0.0);
+				}
+			} else {
+				cairo_arc(cr, cx, cy, r1, a0, a1);
+				if (k > 0)
+					cairo_arc_negative(cr, cx, cy, r0, a1, a0);
+				else
+					cairo_line_to(cr, cx, cy);
+			}
+			cairo_close_path(cr);
+			cairo_fill(cr);
+
+			const char *txt = sc->entries[i].text ? sc->entries[i].text : "";
+			cairo_surface_t *icon = sc->low_quality ? NULL : sc->entries[i].icon;
+			if (k == 0 && count == 1) {
+				draw_label(cr, txt, icon, cx, cy, 0.0, avail_w, avail_h, !sc->low_quality);
+				continue;
+			}
+			double amid = (a0 + a1) * 0.5;
+			double rot = (amid < M_PI) ? amid - M_PI * 0.5 : amid + M_PI * 0.5;
+			draw_label(cr, txt, icon, cx + rmid * cos(amid), cy + rmid * sin(amid), rot, avail_w, avail_h,
+			           !sc->low_quality);
+		}
+	}
+	return 1;
+}
+
+// --- Wedge rasterizer ----------------------------------------------------
+// Wedge fills straight into an image back buffer, without cairo paths. A
+// wedge is the intersection of at most two half-planes through the centre,
+// so on each scanline its extent follows from two linear functions of x.
+// Coverage is the clamped signed distance to each edge: exact for
+// axis-aligned edges, within a few levels of cairo's elsewhere. Fully
+// covered runs are blended four pixels at a time with SSE2.
+
+typedef struct
+{
+	double nx, ny;              // unit normal pointing into the wedge
+} WedgeEdge;
+
+// Wedge i's edges. N = 1 has none, N = 2 one (a half-plane), else two.
+// Narrower wedges get a third edge across the apex: their two edge lines
+// almost coincide, so without it the ray opposite the wedge would pick up
+// the fringes of both.
+static int wedge_edges(int n, int i, WedgeEdge e[3])
+{
+	if (n < 2) return 0;
+	double step = (2.0 * M_PI) / (double)n;
+	double a0 = step * i, a1 = step * (i + 1);
+	// Snap so the N = 2 and N = 4 edges are exactly axis-aligned
+	e[0] = (WedgeEdge){-round(sin(a0) * 1e12) / 1e12, round(cos(a0) * 1e12) / 1e12};
+	if (n == 2) return 1;
+	e[1] = (WedgeEdge){round(sin(a1) * 1e12) / 1e12, -round(cos(a1) * 1e12) / 1e12};
+	if (n <= 4) return 2;
+	e[2] = (WedgeEdge){cos((a0 + a1) * 0.5), sin((a0 + a1) * 0.5)};
+	return 3;
+}
+
+static double clamp01(double v)
+{
+	return v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+}
+
+// One edge on one scanline: pixels in [*lo, *hi) may be covered, those in
+// [*flo, *fhi) are. Returns 0 if the edge excludes the whole row.
+static int edge_span(const WedgeEdge *e, double b, int W, int *lo, int *hi, int *flo, int *fhi)
+{
+	// s(x) = nx * x + b is the signed distance of pixel x's centre
+	if (fabs(e->nx) < 1e-9) {
+		double cov = 0.5 + b;
+		if (cov <= 0.0) return 0;
+		*lo = 0;
+		*hi = W;
+		*flo = 0;
+		*fhi = cov >= 1.0 ? W : 0;  // a partial row is handled per pixel
+		return 1;
+	}
+	double x0 = (-0.5 - b) / e->nx, x1 = (0.5 - b) / e->nx;  // coverage 0 and 1
+	x0 = fmin(fmax(x0, -1.0), W + 1.0);
+	x1 = fmin(fmax(x1, -1.0), W + 1.0);
+	if (e->nx > 0.0) {
+		*lo = (int)floor(x0);
+		*hi = W;
+		*flo = (int)ceil(x1);
+		*fhi = W;
+	} else {
+		*lo = 0;
+		*hi = (int)ceil(x0) + 1;
+		*flo = 0;
+		*fhi = (int)floor(x1) + 1;
+	}
+	return 1;
+}
+
+// dst = src + dst * inv / 255 on premultiplied ARGB32 (src premultiplied).
+static void blend_run(uint32_t *dst, int len, const uint8_t src[4], int inv)
+{
+	int x = 0;
+#ifdef __SSE2__
+	const __m128i s = _mm_set_epi16(src[3], src[2], src[1], src[0], src[3], src[2], src[1], src[0]);
+	const __m128i k = _mm_set1_epi16((int16_t)inv);
+	const __m128i r = _mm_set1_epi16(128);
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 4 <= len; x += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), k);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), k);
+		// (v + 128 + ((v + 128) >> 8)) >> 8 == round(v / 255)
+		lo = _mm_add_epi16(lo, r);
+		hi = _mm_add_epi16(hi, r);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm_add_epi16(lo, s), _mm_add_epi16(hi, s)));
+	}
+#endif
+	for (; x < len; ++x) {
+		uint32_t p = dst[x], o = 0;
+		for (int c = 0; c < 4; ++c) {
+			unsigned v = ((p >> (8 * c)) & 0xff) * (unsigned)inv + 128;
+			o |= (uint32_t)(src[c] + ((v + (v >> 8)) >> 8)) << (8 * c);
+		}
+		dst[x] = o;
+	}
+}
+
+// One edge pixel: the fully covered source prem (premultiplied, 0..255,
+// B, G, R, A in memory order) scaled by its coverage.
+static void blend_pixel(uint32_t *dst, const double prem[4], double cov)
+{
+	uint32_t p = *dst, o = 0;
+	unsigned inv = 255u - (unsigned)(prem[3] * cov + 0.5);
+	for (int c = 0; c < 4; ++c) {
+		unsigned v = ((p >> (8 * c)) & 0xff) * inv + 128;
+		o |= ((unsigned)(prem[c] * cov + 0.5) + ((v + (v >> 8)) >> 8)) << (8 * c);
+	}
+	*dst = o;
+}
+
+// Pixel coverage from the edges' clamped distances. Perpendicular edges
+// (N <= 4) multiply exactly; for acute wedges c0 + c1 - 1 is the right
+// measure where the wedge is thinner than a pixel, which is where it
+// matters (N in the hundreds, near the centre).
+static double wedge_coverage(const WedgeEdge *e, int ne, const double *bk, int x)
+{
+	double c[3];
+	for (int k = 0; k < ne; ++k)
+		c[k] = clamp01(0.5 + e[k].nx * x + bk[k]);
+	if (ne < 3) return ne == 0 ? 1.0 : ne == 1 ? c[0] : c[0] * c[1];
+	return clamp01(c[0] + c[1] - 1.0) * c[2];
+}
+
+// Next to the apex neither estimate holds; count 4x4 samples instead.
+static double wedge_apex_coverage(const WedgeEdge *e, int ne, double vx, double vy)
+{
+	int in = 0;
+	for (int sy = 0; sy < 4; ++sy)
+		for (int sx = 0; sx < 4; ++sx) {
+			double px = vx + (sx - 1.5) * 0.25, py = vy + (sy - 1.5) * 0.25;
+			int inside = 1;
+			for (int k = 0; k < ne && inside; ++k) {
+				double s = e[k].nx * px + e[k].ny * py;
+				inside = k == 0 ? s >= 0.0 : s > 0.0;  // half-open, so neighbours do not overlap
+			}
+			in += inside;
+		}
+	return in / 16.0;
+}
+
+// Image targets without a disc clip; everything else takes cairo paths.
+static int wedge_raster_ok(cairo_t *cr, const Scene *sc)
+{
+	if (sc->low_quality || sc->compact) return 0;
+	cairo_surface_t *t = cairo_get_target(cr);
+	if (cairo_surface_get_type(t) != CAIRO_SURFACE_TYPE_IMAGE) return 0;
+	cairo_format_t fmt = cairo_image_surface_get_format(t);
+	return (fmt == CAIRO_FORMAT_ARGB32 || fmt == CAIRO_FORMAT_RGB24) && cairo_image_surface_get_width(t) >= sc->width
+	       && cairo_image_surface_get_height(t) >= sc->height;
+}
+
+// Wedge colour, as both fill paths use it.
+static void wedge_color(const Scene *sc, int i, double *r, double *g, double *b, double *alpha)
+{
+	double base_v = (i == sc->hover_idx) ? 0.95 : 0.75;
+	hsv_to_rgb((double)i / (double)sc->n, 0.55, base_v, r, g, b);
+	// *alpha = (i == sc->hover_idx) ? 0.80 : 0.55;
+	*alpha = (i == sc->hover_idx) ? 0.50 : 0.40;
+}
+
+// One wedge, set up once per frame.
+typedef struct
+{
+	WedgeEdge e[3];
+	int ne;
+	int y_first, y_end;         // rows it can reach
+	double prem[4];             // premultiplied source, 0..255, B, G, R, A
+	uint8_t full[4];
+	int full_inv;
+} WedgeRaster;
+
+static void wedge_raster_setup(WedgeRaster *w, const Scene *sc, int i)
+{
+	int W = sc->width, H = sc->height, n = sc->n;
+	double cx = W * 0.5, cy = H * 0.5;
+	double r, g, b, alpha;
+	wedge_color(sc, i, &r, &g, &b, &alpha);
+	w->ne = wedge_edges(n, i, w->e);
+	w->prem[0] = b * alpha * 255.0;
+	w->prem[1] = g * alpha * 255.0;
+	w->prem[2] = r * alpha * 255.0;
+	w->prem[3] = alpha * 255.0;
+	for (int c = 0; c < 4; ++c)
+		w->full[c] = (uint8_t)(w->prem[c] + 0.5);
+	w->full_inv = 255 - w->full[3];
+
+	// The apex, where the edges leave the window and any window corner
+	// between them bound the rows
+	w->y_first = 0;
+	w->y_end = H;
+	if (w->ne < 2) return;
+	double step = (2.0 * M_PI) / (double)n, a0 = step * i, a1 = step * (i + 1);
+	double ymin = cy, ymax = cy;
+	for (int k = 0; k < 2; ++k) {
+		double a = k ? a1 : a0;
+		double y = cy + distance_to_rect_edge(W, H, cx, cy, a) * sin(a);
+		ymin = fmin(ymin, y);
+		ymax = fmax(ymax, y);
+	}
+	for (int k = 0; k < 4; ++k) {
+		double xc = (k & 1) ? W : 0, yc = (k & 2) ? H : 0;
+		double a = atan2(yc - cy, xc - cx);
+		if (a < 0.0) a += 2.0 * M_PI;
+		if (a >= a0 && a <= a1) {
+			ymin = fmin(ymin, yc);
+			ymax = fmax(ymax, yc);
+		}
+	}
+	w->y_first = (int)fmax(0.0, floor(ymin) - 1.0);
+	w->y_end = (int)fmin((double)H, ceil(ymax) + 1.0);
+}
+
+// The wedge's span on scanline y: one SSE2 run where it is fully covered
+// (all of a rectangle row for N <= 4) and per-pixel blends at the edges.
+static void wedge_raster_row(const WedgeRaster *w, uint32_t *row, int y, int W, double cx, double cy)
+{
+	double bk[3];
+	int lo = 0, hi = W, flo = 0, fhi = W;
+	for (int k = 0; k < w->ne; ++k) {
+		int l, h, fl, fh;
+		bk[k] = w->e[k].nx * (0.5 - cx) + w->e[k].ny * (y + 0.5 - cy);
+		if (!edge_span(&w->e[k], bk[k], W, &l, &h, &fl, &fh)) return;
+		if (l > lo) lo = l;
+		if (h < hi) hi = h;
+		if (fl > flo) flo = fl;
+		if (fh < fhi) fhi = fh;
+	}
+	if (lo < 0) lo = 0;
+	if (hi > W) hi = W;
+	if (lo >= hi) return;
+	flo = flo < lo ? lo : flo > hi ? hi : flo;
+	fhi = fhi < flo ? flo : fhi > hi ? hi : fhi;
+
+	blend_run(row + flo, fhi - flo, w->full, w->full_inv);
+	for (int x = lo; x < hi; ++x) {
+		if (x == flo && fhi > flo) {
+			x = fhi - 1;
+			continue;
+		}
+		double vx = x + 0.5 - cx, vy = y + 0.5 - cy;
+		double cov = (w->ne == 3 && fabs(vx) < 2.0 && fabs(vy) < 2.0) ? wedge_apex_coverage(w->e, w->ne, vx, vy)
+		                                                              : wedge_coverage(w->e, w->ne, bk, x);
+		if (cov > 0.0) blend_pixel(row + x, w->prem, cov);
+	}
+}
+
+// All wedges into a premultiplied ARGB32 buffer, scanline by scanline so
+// each row stays in cache while every wedge crossing it is blended (in
+// wedge order, as cairo would). Returns 1 when done, 0 if superseded and
+// -1 without memory.
+static int raster_wedges(uint8_t *data, int stride, const Scene *sc)
+{
+	int W = sc->width, H = sc->height, n = sc->n;
+	double cx = W * 0.5, cy = H * 0.5;
+	WedgeRaster *w = (WedgeRaster *)malloc((size_t)n * sizeof(WedgeRaster));
+	if (!w) return -1;
+	for (int i = 0; i < n; ++i)
+		wedge_raster_setup(&w[i], sc, i);
+
+	int done = 1;
+	for (int y = 0; y < H && done; ++y) {
+		if ((y & 63) == 0 && scene_superseded(sc)) done = 0;
+		uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+		for (int i = 0; i < n && done; ++i)
+			if (y >= w[i].y_first && y < w[i].y_end) wedge_raster_row(&w[i], row, y, W, cx, cy);
+	}
+	free(w);
+	return done;
+}
+
+// Both return 0 if the scene was superseded part way.
+static int fill_wedges_cairo(cairo_t *cr, const Scene *sc);
+
+static int fill_wedges_raster(cairo_t *cr, const Scene *sc)
+{
+	cairo_surface_t *t = cairo_get_target(cr);
+	cairo_surface_flush(t);
+	int done = raster_wedges(cairo_image_surface_get_data(t), cairo_image_surface_get_stride(t), sc);
+	cairo_surface_mark_dirty(t);
+	return done < 0 ? fill_wedges_cairo(cr, sc) : done;
+}
+
+static int fill_wedges_cairo(cairo_t *cr, const Scene *sc)
+{
+	int W = sc->width, H = sc->height;
+	double cx = W * 0.5, cy = H * 0.5;
+	double step = (2.0 * M_PI) / (double)sc->n;
+	// Big radius so the arc is outside the window; ensures wedge fills to edges after clipping.
+	double R = hypot((double)W, (double)H);  // safely beyond all corners
+	if (sc->compact) R = compact_disc_radius(W, H);
+
+	for (int i = 0; i < sc->n; ++i) {
+		if (scene_superseded(sc)) return 0;
+		double a0 = step * i;
+		double a1 = step * (i + 1);
+
+		// Fill wedge (semi-transparent over background)
+		double r, g, b, alpha;
+		wedge_color(sc, i, &r, &g, &b, &alpha);
+		set_fill(cr, r, g, b, alpha, sc->low_quality);
+
+		cairo_new_path(cr);
+		cairo_move_to(cr, cx, cy);
+		cairo_line_to(cr, cx + R * cos(a0), cy + R * sin(a0));
+		cairo_arc(cr, cx, cy, R, a0, a1);
+		cairo_close_path(cr);
+		cairo_fill(cr);
+	}
+	return 1;
+}
+
+// Render a frame into any cairo context (the window's back buffer, or a
+// plain image surface in headless mode). Returns 0 if the scene was
+// superseded and the frame abandoned part way.
+static int render_scene(cairo_t *cr, const Scene *sc)
+{
+	int W = sc->width, H = sc->height;
+	double cx = W * 0.5, cy = H * 0.5;
+	const Entry *entries = sc->entries;
+	int n = sc->n;
+
+	cairo_save(cr);
+
+	// Background: screenshot if available, else solid
+	if (sc->bg_image && (!sc->low_quality || sc->bg_on_server)) {
+		cairo_save(cr);
+		double sx = (double)W / (double)sc->bg_w;
+		double sy = (double)H / (double)sc->bg_h;
+		cairo_scale(cr, sx, sy);
+		cairo_set_source_surface(cr, sc->bg_image, 0, 0);
+		cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+		cairo_paint(cr);
+		cairo_restore(cr);
+	} else {
+		cairo_set_source_rgb(cr, 0.08, 0.08, 0.10);
+		cairo_rectangle(cr, 0, 0, W, H);
+		cairo_fill(cr);
+	}
+
+	if (n <= 0) {
+		cairo_set_source_rgb(cr, 0.9, 0.2, 0.2);
+		cairo_select_font_face(cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+		double s = fmin(W, H) * 0.08;
+		cairo_set_font_size(cr, s);
+		const char *msg = "No entries.";
+		cairo_text_extents_t ext;
+		cairo_text_extents(cr, msg, &ext);
+		cairo_move_to(cr, cx - (ext.width * 0.5 + ext.x_bearing), cy - (ext.height * 0.5 + ext.y_bearing));
+		cairo_show_text(cr, msg);
+		cairo_restore(cr);
+		return 1;
+	}
+
+	if (sc->rings > 1) {
+		int done = render_rings(cr, sc);
+		cairo_restore(cr);
+		return done;
+	}
+
+	// All fills first, so no label is covered by a neighbouring wedge
+	int filled = wedge_raster_ok(cr, sc) ? fill_wedges_raster(cr, sc) : fill_wedges_cairo(cr, sc);
+	if (!filled) {
+		cairo_restore(cr);
+		return 0;
+	}
+
+	double step = (2.0 * M_PI) / (double)n;
+	for (int i = 0; i < n; ++i) {
+		if (scene_superseded(sc)) {
+			cairo_restore(cr);
+			return 0;
+		}
+		double a0 = step * i;
+		double a1 = step * (i + 1);
+
+		// Text: place at mid-angle, mid-radius
+		const char *txt = entries[i].text ? entries[i].text : "";
+		double amid = (a0 + a1) * 0.5;
+		double t_edge = distance_to_rect_edge(W, H, cx, cy, amid);
+		double rmid = fmax(10.0, t_edge * 0.5);
+		double px = cx + rmid * cos(amid);
+		double py = cy + rmid * sin(amid);
+
+		// Available width approximated by distance between sector boundaries at rmid
+		double avail_w = fmax(20.0, 0.9 * 2.0 * rmid * sin(step * 0.5));
+		// And limited by distance to nearest window edge to avoid clipping
+		double dist_x = fmin(px, (double)W - px);
+		double dist_y = fmin(py, (double)H - py);
+		avail_w = fmin(avail_w, 1.8 * fmin(dist_x, dist_y));
+		double avail_h = fmin(avail_w, 0.6 * rmid);
+
+		draw_label(cr, txt, sc->low_quality ? NULL : entries[i].icon, px, py, 0.0, avail_w, avail_h,
+		           !sc->low_quality);
+	}
+
+	cairo_restore(cr);
+	return 1;
+}
+
+static void recreate_cairo(App *app);
+
+static const char *quality_name(int q)
+{
+	return q == QUALITY_LOW ? "low-bandwidth" : "full";
+}
+
+// "host:d.s" where host is neither empty nor "unix" goes over TCP; that
+// includes ssh -X, which forwards localhost:10 and up.
+static int display_is_remote(const char *display)
+{
+	if (!display || !*display || display[0] == '/') return 0;  // unset or a socket path
+	const char *colon = strrchr(display, ':');
+	if (!colon || colon == display) return 0;
+	size_t hl = (size_t)(colon - display);
+	return !(hl == 4 && !strncmp(display, "unix", 4));
+}
+
+static void set_quality(App *app, int q, const char *reason)
+{
+	app->quality = q;
+	app->auto_quality = 0;
+	DBG("[piewin] Quality: %s (%s)\n", quality_name(q), reason);
+	if (q == QUALITY_LOW) {
+		g_xstats.backend = "cairo-xcb-server";
+		app->server_side = 1;
+		if (app->csurf) recreate_cairo(app);
+	}
+}
+
+static int draw(App *app, Entry *entries, int n, int hover_idx);
+
+// Render into the back buffer only; present() puts it on screen. On the
+// render thread a newer post abandons the frame and this returns 0.
+static int render_frame(App *app, Entry *entries, int n, int hover_idx)
+{
+	Scene sc = {
+		.width = app->width,
+		.height = app->height,
+		.bg_image = app->bg_image,
+		.bg_w = app->bg_w,
+		.bg_h = app->bg_h,
+		.bg_on_server = app->bg_pixmap != XCB_NONE,
+		.entries = entries,
+		.n = n,
+		.hover_idx = hover_idx,
+		.rings = app->rings,
+		.low_quality = app->quality == QUALITY_LOW,
+		.compact = app->compact,
+		.live_gen = app->render.running ? &app->render.gen : NULL,
+		.gen = app->render.cur_gen,
+	};
+	return render_scene(app->bufcr, &sc);
+}
+
+// Blit the back buffer. The back buffer always holds the latest frame, so
+// Expose only needs this, not a new render (rendered = 0).
+static void present(App *app, Entry *entries, int n, int hover_idx, int64_t start_ns, int rendered)
+{
+	int64_t present_ns = monotonic_ns();
+	present_frame(app, start_ns, rendered);
+
+	// Only the blit is timed: rendering is local work (and the first frame
+	// includes font setup), while a slow blit means a slow connection.
+	present_ns = monotonic_ns() - present_ns;
+	if (app->auto_quality && present_ns > (int64_t)LOWBW_PRESENT_MS * 1000000LL) {
+		DBG("[piewin] Blit took %.1f ms\n", (double)present_ns / 1e6);
+		set_quality(app, QUALITY_LOW, "slow frame");
+		draw(app, entries, n, hover_idx);
+	}
+}
+
+static int draw(App *app, Entry *entries, int n, int hover_idx)
+{
+	int64_t start_ns = monotonic_ns();
+	if (!render_frame(app, entries, n, hover_idx)) {
+		trace_end("draw-superseded", start_ns);
+		return 0;
+	}
+	present(app, entries, n, hover_idx, start_ns, 1);
+	trace_end("draw", start_ns);
+	return 1;
+}
+
+static void recreate_cairo(App *app)
+{
+	if (app->cr) {
+		cairo_destroy(app->cr);
+		app->cr = NULL;
+	}
+	if (app->csurf) {
+		cairo_surface_destroy(app->csurf);
+		app->csurf = NULL;
+	}
+	if (app->bufcr) {
+		cairo_destroy(app->bufcr);
+		app->bufcr = NULL;
+	}
+	if (app->bufsurf) {
+		cairo_surface_destroy(app->bufsurf);
+		app->bufsurf = NULL;
+	}
+	xcb_visualtype_t *vt = find_visualtype(app->screen, app->screen->root_visual);
+	app->csurf = cairo_xcb_surface_create(app->conn, app->win, vt, app->width, app->height);
+	app->cr = cairo_create(app->csurf);
+	cairo_set_antialias(app->cr, CAIRO_ANTIALIAS_FAST);
+
+	// Server-side mode keeps the back buffer in a pixmap so drawing and the
+	// blit are RENDER requests and no frame pixels cross the connection.
+	if (app->server_side)
+		app->bufsurf = cairo_surface_create_similar(app->csurf, CAIRO_CONTENT_COLOR_ALPHA, app->width, app->height);
+	else
+		app->bufsurf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, app->width, app->height);
+	app->bufcr = cairo_create(app->bufsurf);
+	cairo_set_antialias(app->bufcr, app->quality == QUALITY_LOW ? CAIRO_ANTIALIAS_NONE : CAIRO_ANTIALIAS_FAST);
+
+	DBG("[piewin] Recreated Cairo surfaces %dx%d (double-buffer)\n", app->width, app->height);
+}
+
+// --- Render thread -------------------------------------------------------
+// After renderer_start() the render thread owns everything drawing touches
+// (surfaces, app->width/height, quality); the event loop keeps its own copy
+// of the window size for hit testing and talks to it only through posts.
+
+static void *render_thread_main(void *arg)
+{
+	App *app = (App *)arg;
+	Renderer *r = &app->render;
+	int hover_idx = r->hover_idx;
+	t_trace_tid = TRACE_TID_RENDER;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (!r->quit && !r->frame && !r->resize_w && !r->n_damage)
+			pthread_cond_wait(&r->wake, &r->lock);
+		if (r->quit) break;
+
+		// Take the whole request; posts arriving meanwhile queue the next one
+		int frame = r->frame, w = r->resize_w, h = r->resize_h, n_damage = r->n_damage;
+		xcb_rectangle_t damage[EXPOSE_MAX_RECTS];
+		memcpy(damage, r->damage, (size_t)n_damage * sizeof(damage[0]));
+		hover_idx = r->hover_idx;
+		r->cur_gen = atomic_load(&r->gen);
+		app->stats.event_ns = r->event_ns;
+		r->frame = r->resize_w = r->resize_h = r->n_damage = 0;
+		r->event_ns = 0;
+		pthread_mutex_unlock(&r->lock);
+
+		if (w && (w != app->width || h != app->height)) {
+			app->width = w;
+			app->height = h;
+			DBG("[render] RESIZE -> %dx%d (recreate surfaces)\n", w, h);
+			recreate_cairo(app);
+		}
+
+		// A frame replaces the whole window, so it also repairs any damage
+		int64_t t0 = monotonic_ns();
+		if (frame) {
+			if (!draw(app, r->entries, r->n, hover_idx))
+				DBG("[render] Frame for hover=%d superseded\n", hover_idx);
+		} else if (n_damage == 1 && damage[0].width >= app->width && damage[0].height >= app->height) {
+			present(app, r->entries, r->n, hover_idx, t0, 0);  // first map
+			trace_end("present", t0);
+		} else if (n_damage) {
+			present_rects(app, damage, n_damage);
+			trace_end("present", t0);
+		}
+
+		pthread_mutex_lock(&r->lock);
+		// An abandoned frame's input is shown by the next one
+		int64_t lost_ns = app->stats.event_ns;
+		if (lost_ns && (!r->event_ns || lost_ns < r->event_ns)) r->event_ns = lost_ns;
+		app->stats.event_ns = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+// Returns 0 if the thread could not be started; posts then render and
+// present synchronously, as before.
+static int renderer_start(App *app, Entry *entries, int n, int hover_idx)
+{
+	Renderer *r = &app->render;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wake, NULL);
+	r->entries = entries;
+	r->n = n;
+	r->hover_idx = hover_idx;
+	r->running = 1;
+	int err = pthread_create(&r->thread, NULL, render_thread_main, app);
+	if (err) {
+		r->running = 0;
+		DBG("[render] pthread_create failed: %s; rendering on the event loop\n", strerror(err));
+		return 0;
+	}
+	return 1;
+}
+
+static void renderer_stop(App *app)
+{
+	Renderer *r = &app->render;
+	if (!r->running) return;
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	atomic_fetch_add(&r->gen, 1);  // abandon a frame in progress
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	r->running = 0;
+}
+
+// New hover state. event_ns is the input that caused it, for --stats.
+static void renderer_post(App *app, int hover_idx, int64_t event_ns)
+{
+	Renderer *r = &app->render;
+	if (!r->running) {
+		r->hover_idx = hover_idx;
+		app->stats.event_ns = event_ns;
+		draw(app, r->entries, r->n, hover_idx);
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	atomic_fetch_add(&r->gen, 1);
+	r->frame = 1;
+	r->hover_idx = hover_idx;
+	if (event_ns && !r->event_ns) r->event_ns = event_ns;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// The window was resized; redraw says whether a frame should follow.
+static void renderer_resize(App *app, int w, int h, int redraw)
+{
+	Renderer *r = &app->render;
+	if (!r->running) {
+		app->width = w;
+		app->height = h;
+		recreate_cairo(app);
+		if (redraw) draw(app, r->entries, r->n, r->hover_idx);
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	atomic_fetch_add(&r->gen, 1);  // a frame at the old size is wasted work
+	r->resize_w = w;
+	r->resize_h = h;
+	r->frame |= redraw;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// A complete Expose series. A pending frame covers it anyway.
+static void renderer_expose(App *app, const xcb_rectangle_t *rects, int n)
+{
+	Renderer *r = &app->render;
+	if (!r->running) {
+		int64_t t0 = monotonic_ns();
+		if (n == 1 && rects[0].width >= app->width && rects[0].height >= app->height)
+			present(app, r->entries, r->n, r->hover_idx, t0, 0);
+		else
+			present_rects(app, rects, n);
+		trace_end("present", t0);
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	for (int i = 0; i < n; ++i)
+		damage_add(r->damage, &r->n_damage, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void set_fullscreen_hint(App *app)
+{
+	// Set initial _NET_WM_STATE to FULLSCREEN before mapping (best-effort)
+	if (app->NET_WM_STATE != XCB_NONE && app->NET_WM_STATE_FULLSCREEN != XCB_NONE) {
+		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->NET_WM_STATE, XCB_ATOM_ATOM, 32, 1, &app->NET_WM_STATE_FULLSCREEN);
+	}
+}
+
+static void set_wm_delete_protocol(App *app)
+{
+	if (app->WM_PROTOCOLS != XCB_NONE && app->WM_DELETE_WINDOW != XCB_NONE) {
+		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->WM_PROTOCOLS, XCB_ATOM_ATOM, 32, 1, &app->WM_DELETE_WINDOW);
+	}
+}
+
+static void set_window_title(App *app, const char *title)
 {
 	// Prefer _NET_WM_NAME with UTF8_STRING, also set WM_NAME for compatibility.
 	if (app->NET_WM_NAME != XCB_NONE) {
 		xcb_atom_t type = (app->UTF8_STRING != XCB_NONE) ? app->UTF8_STRING : XCB_ATOM_STRING;
 		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->NET_WM_NAME, type, 8, strlen(title), title);
 	}
-	if (app->WM_NAME_ATOM != XCB_NONE) {
-		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->WM_NAME_ATOM, XCB_ATOM_STRING, 8, strlen(title), title);
+	if (app->WM_NAME_ATOM != XCB_NONE) {
+		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, app->win, app->WM_NAME_ATOM, XCB_ATOM_STRING, 8, strlen(title), title);
+	}
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "gzg – XCB+Cairo fullscreen chooser\n");
+	fprintf(stderr, "Usage: echo -e \"A\\nB\\nC\" | %s [options]\n", argv0);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -h, --help            Show this help and exit\n");
+	fprintf(stderr, "  -kmp, --keep-mouse-pos\n");
+	fprintf(stderr, "                        Do not move the mouse pointer to screen center\n");
+	fprintf(stderr, "                        and do not restore it after exit.\n");
+	fprintf(stderr, "  -s, --screenshot      Use a dimmed screenshot as background and mark\n");
+	fprintf(stderr, "                        the original cursor position with a red circle.\n");
+	fprintf(stderr, "  -ss, --server-screenshot\n");
+	fprintf(stderr, "                        Like -s, but copy, dim and mark the screen on the\n");
+	fprintf(stderr, "                        X server (CopyArea + RENDER) so no pixels cross the\n");
+	fprintf(stderr, "                        connection. Much faster on remote displays.\n");
+	fprintf(stderr, "  -fg, --frosted        Like -s, but blur the screenshot (frosted glass) so\n");
+	fprintf(stderr, "                        labels stay readable. Ignored with -ss.\n");
+	fprintf(stderr, "      --desaturate PCT  With -fg, also drain PCT %% of the colour (0-100).\n");
+	fprintf(stderr, "  -c, --compact         Small pie around the pointer instead of a fullscreen\n");
+	fprintf(stderr, "                        window (implies -or). With -s only the area under\n");
+	fprintf(stderr, "                        it is captured.\n");
+	fprintf(stderr, "                        A click outside the disc cancels.\n");
+	fprintf(stderr, "      --radius PX       Compact pie radius (default: %d, implies -c).\n", COMPACT_DEFAULT_RADIUS);
+	fprintf(stderr, "  -or, --override-redirect\n");
+	fprintf(stderr, "                        Bypass the window manager: cover the pointer's\n");
+	fprintf(stderr, "                        monitor (RandR) and map and grab immediately.\n");
+	fprintf(stderr, "  -lb, --low-bandwidth  Draw everything on the X server with solid colours,\n");
+	fprintf(stderr, "                        no shadows or icons, and no screenshot unless -ss.\n");
+	fprintf(stderr, "                        Chosen automatically for remote displays or after\n");
+	fprintf(stderr, "                        a slow frame.\n");
+	fprintf(stderr, "  -mm, --marking        Marking menu: a quick stroke from the start position\n");
+	fprintf(stderr, "                        followed by a click, or a stroke past a quarter of\n");
+	fprintf(stderr, "                        the screen, selects by direction without drawing.\n");
+	fprintf(stderr, "                        The menu is drawn when the pointer pauses.\n");
+	fprintf(stderr, "  -r, --rings           Lay entries out on concentric rings instead of one\n");
+	fprintf(stderr, "                        wedge each; keeps labels readable with many entries.\n");
+	fprintf(stderr, "                        Ignored with -mm.\n");
+	fprintf(stderr, "  -m, --multiple        Allow multiple instances (disables single-instance\n");
+	fprintf(stderr, "                        lock; by default only one instance per user and\n");
+	fprintf(stderr, "                        $DISPLAY can run).\n");
+	fprintf(stderr, "  -nkb, --no-keyboard   Disable all keyboard handling (Esc, arrows, hjkl,\n");
+	fprintf(stderr, "                        Enter). Mouse-only mode.\n");
+	fprintf(stderr, "  -t, --type            Instead of printing selection to stdout, type it via\n");
+	fprintf(stderr, "                        XTEST virtual keypresses after closing. Typing starts\n");
+	fprintf(stderr, "                        once focus is back on the previous window (at most\n");
+	fprintf(stderr, "                        %dms).\n", TYPE_FOCUS_TIMEOUT_MS);
+	fprintf(stderr, "      --type-hex        With --type, enter characters missing from the\n");
+	fprintf(stderr, "                        keyboard layout via Ctrl+Shift+U hex input instead\n");
+	fprintf(stderr, "                        of temporarily remapping spare keycodes.\n");
+	fprintf(stderr, "  -p, --paste           Instead of printing selection to stdout, put it on\n");
+	fprintf(stderr, "                        CLIPBOARD/PRIMARY and send a paste chord via XTEST\n");
+	fprintf(stderr, "                        after closing. Exits once the paste was served.\n");
+	fprintf(stderr, "      --paste-chord C   Chord to send in --paste mode (default: %s),\n", PASTE_DEFAULT_CHORD);
+	fprintf(stderr, "                        e.g. ctrl+shift+v or shift+insert.\n");
+	fprintf(stderr, "      --timeout SEC     Exit after SEC seconds without selection\n");
+	fprintf(stderr, "                        (default: 10). Applies to all modes.\n");
+	fprintf(stderr, "Developer options (see dev.sh):\n");
+	fprintf(stderr, "      --stats           Print input-to-render latency and render time\n");
+	fprintf(stderr, "                        histograms to stderr on exit.\n");
+	fprintf(stderr, "      --stats-overlay   Like --stats, plus live frame time and p99 latency\n");
+	fprintf(stderr, "                        in the top-left corner.\n");
+	fprintf(stderr, "      --render-png PATH Render one frame headless (no X connection) to PATH.\n");
+	fprintf(stderr, "      --render-compare PATH\n");
+	fprintf(stderr, "                        Render headless and compare against a golden PNG;\n");
+	fprintf(stderr, "                        exit 1 on mismatch.\n");
+	fprintf(stderr, "      --render-bench FRAMES\n");
+	fprintf(stderr, "                        Render FRAMES frames headless and print timing JSON.\n");
+	fprintf(stderr, "      --size WxH        Headless frame size (default: 1920x1080).\n");
+	fprintf(stderr, "      --hover I         Headless hovered entry (default: last).\n");
+	fprintf(stderr, "      --entries-file F  Headless entries from F instead of stdin.\n");
+	fprintf(stderr, "      --synthetic N     Headless entries \"Entry 1\" .. \"Entry N\".\n");
+	fprintf(stderr, "      --bench NAME      Run a microbenchmark and print JSON: draw,\n");
+	fprintf(stderr, "                        wedge_fill, fit_font_size, sector_index_from_point,\n");
+	fprintf(stderr, "                        distance_to_rect_edge, screenshot_convert,\n");
+	fprintf(stderr, "                        screenshot_dim, bg_effects, utf8_decode, stdin\n");
+	fprintf(stderr, "                        or all.\n");
+	fprintf(stderr, "                        Uses --size, --synthetic N and --rings.\n");
+	fprintf(stderr, "      --record PATH     Log input events with their timing to PATH.\n");
+	fprintf(stderr, "      --replay PATH     Re-run a --record log headless and print per-event\n");
+	fprintf(stderr, "                        timing as JSON.\n");
+	fprintf(stderr, "      --replay-realtime Keep the recorded pacing (default: as fast as possible).\n");
+	fprintf(stderr, "      --bench-type CORPUS\n");
+	fprintf(stderr, "                        Type a built-in corpus (ascii, latin1, cjk, emoji,\n");
+	fprintf(stderr, "                        cyrillic) into the focused window and print timing\n");
+	fprintf(stderr, "                        as JSON. No window is shown.\n");
+	fprintf(stderr, "      --bench-type-receiver CORPUS\n");
+	fprintf(stderr, "                        Grab the keyboard, decode incoming keys and report\n");
+	fprintf(stderr, "                        mismatches against CORPUS as JSON.\n");
+}
+
+// Started from a key binding (i3 bindsym, sxhkd), the binding's own grab
+// may still be active for a moment, so a grab answered AlreadyGrabbed or
+// Frozen is retried for up to GRAB_RETRY_MS. Returns the last status.
+static uint8_t grab_pointer_retry(App *app)
+{
+	uint8_t status = XCB_GRAB_STATUS_ALREADY_GRABBED;
+	for (int ms = 0; ms <= GRAB_RETRY_MS; ms += GRAB_RETRY_POLL_MS) {
+		xcb_grab_pointer_cookie_t pc =
+		    xcb_grab_pointer(app->conn,
+		                     0,                 // owner_events
+		                     app->win,          // grab on our window
+		                     XCB_EVENT_MASK_BUTTON_PRESS |
+		                         XCB_EVENT_MASK_BUTTON_RELEASE |
+		                         XCB_EVENT_MASK_POINTER_MOTION,
+		                     XCB_GRAB_MODE_ASYNC,
+		                     XCB_GRAB_MODE_ASYNC,
+		                     // Compact mode leaves the pointer free so clicks
+		                     // outside the small window can cancel.
+		                     app->compact ? XCB_NONE : app->win,  // confine_to
+		                     XCB_NONE,          // cursor
+		                     XCB_CURRENT_TIME);
+		xcb_grab_pointer_reply_t *pr = xstats_reply(xcb_grab_pointer_reply(app->conn, pc, NULL));
+		if (!pr) return status;
+		status = pr->status;
+		free(pr);
+		if (status != XCB_GRAB_STATUS_ALREADY_GRABBED && status != XCB_GRAB_STATUS_FROZEN) break;
+		sleep_ms(GRAB_RETRY_POLL_MS);
+	}
+	return status;
+}
+
+static uint8_t grab_keyboard_retry(App *app)
+{
+	uint8_t status = XCB_GRAB_STATUS_ALREADY_GRABBED;
+	for (int ms = 0; ms <= GRAB_RETRY_MS; ms += GRAB_RETRY_POLL_MS) {
+		xcb_grab_keyboard_cookie_t kc =
+		    xcb_grab_keyboard(app->conn,
+		                      0,
+		                      app->win,
+		                      XCB_CURRENT_TIME,
+		                      XCB_GRAB_MODE_ASYNC,
+		                      XCB_GRAB_MODE_ASYNC);
+		xcb_grab_keyboard_reply_t *kr = xstats_reply(xcb_grab_keyboard_reply(app->conn, kc, NULL));
+		if (!kr) return status;
+		status = kr->status;
+		free(kr);
+		if (status != XCB_GRAB_STATUS_ALREADY_GRABBED && status != XCB_GRAB_STATUS_FROZEN) break;
+		sleep_ms(GRAB_RETRY_POLL_MS);
+	}
+	return status;
+}
+
+// Without a WM (override-redirect) nothing else focuses the window, so a
+// keyboard grab that still fails falls back to taking focus; ungrab_input
+// hands it back.
+static void grab_input(App *app, int grab_keyboard, int take_focus)
+{
+	// Grab pointer to avoid click-through to underlying apps.
+	uint8_t ps = grab_pointer_retry(app);
+	DBG("[piewin] Grab pointer status=%u\n", ps);
+
+	// Optionally grab keyboard so Esc/hjkl/arrows don't leak.
+	if (grab_keyboard) {
+		uint8_t ks = grab_keyboard_retry(app);
+		DBG("[piewin] Grab keyboard status=%u\n", ks);
+		if (ks != XCB_GRAB_STATUS_SUCCESS && take_focus) {
+			xcb_get_input_focus_reply_t *fr =
+			    xstats_reply(xcb_get_input_focus_reply(app->conn, xcb_get_input_focus(app->conn), NULL));
+			app->focus_before = fr ? fr->focus : XCB_NONE;
+			free(fr);
+			xcb_set_input_focus(app->conn, XCB_INPUT_FOCUS_POINTER_ROOT, app->win, XCB_CURRENT_TIME);
+			app->took_focus = 1;
+			DBG("[piewin] Keyboard grab failed, focusing the window (was 0x%08x)\n",
+			    (unsigned)app->focus_before);
+		}
+	} else {
+		DBG("[piewin] Keyboard grab skipped (no-keyboard mode)\n");
+	}
+	xcb_flush(app->conn);
+}
+
+static void ungrab_input(App *app)
+{
+	xcb_ungrab_pointer(app->conn, XCB_CURRENT_TIME);
+	xcb_ungrab_keyboard(app->conn, XCB_CURRENT_TIME);
+	// PointerRoot and None are valid focus values too
+	if (app->took_focus)
+		xcb_set_input_focus(app->conn, XCB_INPUT_FOCUS_POINTER_ROOT, app->focus_before, XCB_CURRENT_TIME);
+	xcb_flush(app->conn);
+	DBG("[piewin] Ungrab input\n");
+}
+
+// --- Background effects --------------------------------------------------
+// --frosted: the screenshot is blurred, dimmed and optionally desaturated
+// before the pie is drawn over it. The blur runs at 1/FROST_SCALE
+// resolution as FROST_PASSES box blurs with running sums, so its cost does
+// not depend on the radius; a pixel's four float channels are one SSE
+// register there. Desaturating and dimming are linear, so they commute with
+// the bilinear upscale and are applied to the small image in the last blur
+// pass. The full-size pixels are read once (downsample) and written once
+// (compose). Each stage splits its rows (or columns) over up to
+// FROST_MAX_THREADS threads.
+
+typedef struct
+{
+	uint8_t *px;               // full-size image (B, G, R, X), modified in place
+	int W, H, stride;
+	float *a, *b;              // small image and scratch, 4 channels 0..255
+	int sw, sh;
+	int radius;                // box radius at small resolution
+	float inv;                 // 1 / box width
+	float *sums;               // vertical running sums, 4 * sw
+	int16_t *rows;             // per-thread rows in 16ths, 4 * (sw + 1) each
+	const uint16_t *col_x;     // per output column: left small pixel
+	const uint8_t *col_w;      // and the weight of the one after it, 0..16
+	float desat;               // 0..1
+	float keep;                // 1 - FROST_DIM
+} FrostJob;
+
+typedef void (*FrostStage)(const FrostJob *job, int from, int to, int slot);
+
+typedef struct
+{
+	FrostStage fn;
+	const FrostJob *job;
+	int from, to, slot;
+} FrostSlice;
+
+static void *frost_slice_main(void *arg)
+{
+	FrostSlice *s = (FrostSlice *)arg;
+	s->fn(s->job, s->from, s->to, s->slot);
+	return NULL;
+}
+
+// Run fn over [0, n) in `threads` slices, one on the calling thread. A
+// slice whose thread cannot be started runs here too.
+static void frost_parallel(FrostStage fn, const FrostJob *job, int n, int threads)
+{
+	FrostSlice s[FROST_MAX_THREADS];
+	pthread_t tid[FROST_MAX_THREADS];
+	int started[FROST_MAX_THREADS] = {0};
+	if (threads > n) threads = n;
+	if (threads < 1) return;
+	for (int t = 0; t < threads; ++t)
+		s[t] = (FrostSlice){fn, job, (int)((long)n * t / threads), (int)((long)n * (t + 1) / threads), t};
+	for (int t = 1; t < threads; ++t)
+		started[t] = pthread_create(&tid[t], NULL, frost_slice_main, &s[t]) == 0;
+	fn(job, s[0].from, s[0].to, 0);
+	for (int t = 1; t < threads; ++t) {
+		if (started[t])
+			pthread_join(tid[t], NULL);
+		else
+			fn(job, s[t].from, s[t].to, t);
+	}
+}
+
+static int frost_threads(int want)
+{
+	long n = want > 0 ? want : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	return n > FROST_MAX_THREADS ? FROST_MAX_THREADS : (int)n;
+}
+
+// Source position of full-size pixel i in a small image of n pixels: the
+// left/top one and the next one's weight in 16ths (pixel centres aligned).
+static void frost_source(int i, int n, int *at, int *w)
+{
+	int p = (2 * i + 1) * 8 / FROST_SCALE - 8;
+	if (p < 0) p = 0;
+	*at = p >> 4;
+	*w = p & 15;
+	if (*at >= n - 1) {
+		*at = n - 1;
+		*w = 0;
+	}
+}
+
+// Box averages of FROST_SCALE x FROST_SCALE blocks into a (small rows from..to).
+static void frost_downsample(const FrostJob *j, int from, int to, int slot)
+{
+	(void)slot;
+	for (int sy = from; sy < to; ++sy) {
+		int y0 = sy * FROST_SCALE;
+		int ny = j->H - y0 < FROST_SCALE ? j->H - y0 : FROST_SCALE;
+		const uint8_t *src = j->px + (size_t)y0 * j->stride;
+		float *out = j->a + (size_t)sy * j->sw * 4;
+		int sx = 0;
+#ifdef __SSE2__
+		if (FROST_SCALE == 4 && ny == 4) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 k = _mm_set1_ps(1.0f / 16.0f);
+			for (; sx * 4 + 4 <= j->W; ++sx) {
+				__m128i lo = zero, hi = zero;
+				for (int i = 0; i < 4; ++i) {
+					__m128i p = _mm_loadu_si128((const __m128i *)(src + (size_t)i * j->stride + sx * 16));
+					lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(p, zero));
+					hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(p, zero));
+				}
+				__m128i sum = _mm_add_epi16(lo, hi);
+				sum = _mm_unpacklo_epi16(_mm_add_epi16(sum, _mm_srli_si128(sum, 8)), zero);
+				_mm_storeu_ps(out + sx * 4, _mm_mul_ps(_mm_cvtepi32_ps(sum), k));
+			}
+		}
+#endif
+		for (; sx < j->sw; ++sx) {
+			int x0 = sx * FROST_SCALE;
+			int nx = j->W - x0 < FROST_SCALE ? j->W - x0 : FROST_SCALE;
+			int sum[4] = {0, 0, 0, 0};
+			float k = 1.0f / (float)(nx * ny);
+			for (int i = 0; i < ny; ++i) {
+				const uint8_t *p = src + (size_t)i * j->stride + x0 * 4;
+				for (int c = 0; c < nx * 4; ++c)
+					sum[c & 3] += p[c];
+			}
+			for (int c = 0; c < 4; ++c)
+				out[sx * 4 + c] = (float)sum[c] * k;
+		}
+	}
+}
+
+// One box pass along a row of n pixels, edges clamped.
+static void frost_box_row(const float *in, float *out, int n, int r, float inv)
+{
+#ifdef __SSE2__
+	const __m128 k = _mm_set1_ps(inv);
+	__m128 s = _mm_mul_ps(_mm_loadu_ps(in), _mm_set1_ps((float)(r + 1)));
+	for (int i = 1; i <= r; ++i)
+		s = _mm_add_ps(s, _mm_loadu_ps(in + (i < n ? i : n - 1) * 4));
+	for (int x = 0; x < n; ++x) {
+		_mm_storeu_ps(out + x * 4, _mm_mul_ps(s, k));
+		__m128 add = _mm_loadu_ps(in + (x + r + 1 < n ? x + r + 1 : n - 1) * 4);
+		s = _mm_add_ps(s, _mm_sub_ps(add, _mm_loadu_ps(in + (x - r > 0 ? x - r : 0) * 4)));
+	}
+#else
+	float s[4];
+	for (int c = 0; c < 4; ++c)
+		s[c] = in[c] * (float)(r + 1);
+	for (int i = 1; i <= r; ++i)
+		for (int c = 0; c < 4; ++c)
+			s[c] += in[(i < n ? i : n - 1) * 4 + c];
+	for (int x = 0; x < n; ++x) {
+		const float *add = in + (x + r + 1 < n ? x + r + 1 : n - 1) * 4;
+		const float *sub = in + (x - r > 0 ? x - r : 0) * 4;
+		for (int c = 0; c < 4; ++c) {
+			out[x * 4 + c] = s[c] * inv;
+			s[c] += add[c] - sub[c];
+		}
+	}
+#endif
+}
+
+// Horizontal passes over small rows from..to, in place in a (b is scratch).
+static void frost_blur_rows(const FrostJob *j, int from, int to, int slot)
+{
+	(void)slot;
+	size_t rs = (size_t)j->sw * 4;
+	for (int y = from; y < to; ++y) {
+		float *row = j->a + y * rs, *tmp = j->b + y * rs;
+		for (int p = 0; p < FROST_PASSES; ++p) {
+			memcpy(tmp, row, rs * sizeof(*row));
+			frost_box_row(tmp, row, j->sw, j->radius, j->inv);
+		}
+	}
+}
+
+// Desaturate towards BT.709 luma, then dim, n pixels in place.
+static void frost_tone(const FrostJob *j, float *p, int n)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128 luma = _mm_set_ps(0.0f, 0.2126f, 0.7152f, 0.0722f);
+	const __m128 desat = _mm_set1_ps(j->desat), keep = _mm_set1_ps(j->keep);
+	for (; i < n; ++i) {
+		__m128 c = _mm_loadu_ps(p + i * 4);
+		__m128 y = _mm_mul_ps(c, luma);
+		y = _mm_add_ps(y, _mm_shuffle_ps(y, y, _MM_SHUFFLE(1, 0, 3, 2)));
+		y = _mm_add_ps(y, _mm_shuffle_ps(y, y, _MM_SHUFFLE(2, 3, 0, 1)));
+		c = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(y, c), desat));
+		_mm_storeu_ps(p + i * 4, _mm_mul_ps(c, keep));
+	}
+#endif
+	for (; i < n; ++i) {
+		float *c = p + i * 4;
+		float y = (c[0] * 0.0722f + c[2] * 0.2126f) + (c[1] * 0.7152f + c[3] * 0.0f);
+		for (int k = 0; k < 4; ++k)
+			c[k] = (c[k] + (y - c[k]) * j->desat) * j->keep;
+	}
+}
+
+// Vertical passes over small columns from..to, alternating between a and
+// b; the last one also tones. Running sums for a whole band of columns are
+// updated row by row, so memory is walked in order.
+static void frost_blur_cols(const FrostJob *j, int from, int to, int slot)
+{
+	(void)slot;
+	size_t rs = (size_t)j->sw * 4;
+	int n = (to - from) * 4, r = j->radius, h = j->sh;
+	float *s = j->sums + from * 4;
+	for (int p = 0; p < FROST_PASSES; ++p) {
+		const float *in = (p & 1 ? j->b : j->a) + from * 4;
+		float *out = (p & 1 ? j->a : j->b) + from * 4;
+		for (int i = 0; i < n; ++i)
+			s[i] = in[i] * (float)(r + 1);
+		for (int k = 1; k <= r; ++k) {
+			const float *row = in + (k < h ? k : h - 1) * rs;
+			for (int i = 0; i < n; ++i)
+				s[i] += row[i];
+		}
+		for (int y = 0; y < h; ++y) {
+			float *o = out + y * rs;
+			const float *add = in + (y + r + 1 < h ? y + r + 1 : h - 1) * rs;
+			const float *sub = in + (y - r > 0 ? y - r : 0) * rs;
+			int i = 0;
+#ifdef __SSE2__
+			const __m128 k = _mm_set1_ps(j->inv);
+			for (; i < n; i += 4) {
+				__m128 v = _mm_loadu_ps(s + i);
+				_mm_storeu_ps(o + i, _mm_mul_ps(v, k));
+				v = _mm_add_ps(v, _mm_sub_ps(_mm_loadu_ps(add + i), _mm_loadu_ps(sub + i)));
+				_mm_storeu_ps(s + i, v);
+			}
+#endif
+			for (; i < n; ++i) {
+				o[i] = s[i] * j->inv;
+				s[i] += add[i] - sub[i];
+			}
+			if (p == FROST_PASSES - 1) frost_tone(j, o, to - from);
+		}
+	}
+}
+
+// Full-size pixel x from v (a small row in 16ths, last pixel repeated).
+static uint32_t frost_pixel(const FrostJob *j, const int16_t *v, int x)
+{
+	const int16_t *l = v + j->col_x[x] * 4, *r = l + 4;
+	int w = j->col_w[x];
+	uint32_t o = 0xff000000u;
+	for (int k = 0; k < 3; ++k)
+		o |= (uint32_t)((l[k] * (16 - w) + r[k] * w + 128) >> 8) << (8 * k);
+	return o;
+}
+
+// One full-size row: horizontal interpolation.
+static void frost_row(const FrostJob *j, const int16_t *v, uint32_t *out)
+{
+	int x = 0;
+#ifdef __SSE2__
+	if (FROST_SCALE == 4 && j->W >= 2) {
+		// Away from the edges, pixels 4m + 2 .. 4m + 5 all lie between small
+		// pixels m and m + 1, at 2, 6, 10 and 14 sixteenths.
+		const __m128i w0 = _mm_set_epi16(6, 6, 6, 6, 2, 2, 2, 2), k0 = _mm_set_epi16(10, 10, 10, 10, 14, 14, 14, 14);
+		const __m128i w1 = _mm_set_epi16(14, 14, 14, 14, 10, 10, 10, 10), k1 = _mm_set_epi16(2, 2, 2, 2, 6, 6, 6, 6);
+		const __m128i half = _mm_set1_epi16(128), alpha = _mm_set1_epi32((int)0xff000000u);
+		for (; x < 2; ++x)
+			out[x] = frost_pixel(j, v, x);
+		for (int m = 0; x + 4 <= j->W && m + 1 < j->sw; ++m, x += 4) {
+			__m128i p = _mm_loadu_si128((const __m128i *)(v + m * 4));
+			__m128i l = _mm_unpacklo_epi64(p, p), r = _mm_unpackhi_epi64(p, p);
+			__m128i a = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(l, k0), _mm_mullo_epi16(r, w0)), half);
+			__m128i b = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(l, k1), _mm_mullo_epi16(r, w1)), half);
+			a = _mm_srli_epi16(a, 8);
+			b = _mm_srli_epi16(b, 8);
+			_mm_storeu_si128((__m128i *)(out + x), _mm_or_si128(_mm_packus_epi16(a, b), alpha));
+		}
+	}
+#endif
+	for (; x < j->W; ++x)
+		out[x] = frost_pixel(j, v, x);
+}
+
+// Full-size rows from..to from the blurred small image.
+static void frost_compose(const FrostJob *j, int from, int to, int slot)
+{
+	const float *img = FROST_PASSES & 1 ? j->b : j->a;
+	size_t rs = (size_t)j->sw * 4;
+	int16_t *v = j->rows + (size_t)slot * (rs + 4);
+	for (int y = from; y < to; ++y) {
+		int sy, wy;
+		frost_source(y, j->sh, &sy, &wy);
+		const float *t = img + sy * rs, *u = wy ? t + rs : t;
+		const float kt = (float)(16 - wy), ku = (float)wy;
+		size_t i = 0;
+#ifdef __SSE2__
+		const __m128 vt = _mm_set1_ps(kt), vu = _mm_set1_ps(ku), half = _mm_set1_ps(0.5f);
+		for (; i + 8 <= rs; i += 8) {
+			__m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(t + i), vt), _mm_mul_ps(_mm_loadu_ps(u + i), vu));
+			__m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(t + i + 4), vt), _mm_mul_ps(_mm_loadu_ps(u + i + 4), vu));
+			__m128i lo = _mm_cvttps_epi32(_mm_add_ps(a, half)), hi = _mm_cvttps_epi32(_mm_add_ps(b, half));
+			_mm_storeu_si128((__m128i *)(v + i), _mm_packs_epi32(lo, hi));
+		}
+#endif
+		for (; i < rs; ++i)
+			v[i] = (int16_t)(t[i] * kt + u[i] * ku + 0.5f);
+		memcpy(v + rs, v + rs - 4, 4 * sizeof(*v));
+		frost_row(j, v, (uint32_t *)(j->px + (size_t)y * j->stride));
+	}
+}
+
+// Frost a 32-bit image surface in place. Returns 0 (image untouched) for
+// other surfaces or without memory; the caller then dims it plainly.
+static int frost_apply(cairo_surface_t *img, const FrostOpts *fo)
+{
+	if (cairo_surface_get_type(img) != CAIRO_SURFACE_TYPE_IMAGE) return 0;
+	cairo_format_t fmt = cairo_image_surface_get_format(img);
+	if (fmt != CAIRO_FORMAT_ARGB32 && fmt != CAIRO_FORMAT_RGB24) return 0;
+	FrostJob j = {0};
+	j.W = cairo_image_surface_get_width(img);
+	j.H = cairo_image_surface_get_height(img);
+	j.stride = cairo_image_surface_get_stride(img);
+	if (j.W < 1 || j.H < 1) return 0;
+	j.sw = (j.W + FROST_SCALE - 1) / FROST_SCALE;
+	j.sh = (j.H + FROST_SCALE - 1) / FROST_SCALE;
+	j.radius = FROST_RADIUS_PX / FROST_SCALE > 0 ? FROST_RADIUS_PX / FROST_SCALE : 1;
+	j.inv = 1.0f / (float)(2 * j.radius + 1);
+	j.desat = (float)(fo->desaturate < 0.0 ? 0.0 : fo->desaturate > 1.0 ? 1.0 : fo->desaturate);
+	j.keep = (float)(1.0 - FROST_DIM);
+	int threads = frost_threads(fo->threads);
+
+	size_t small = (size_t)j.sw * j.sh * 4;
+	j.a = (float *)malloc(small * sizeof(float));
+	j.b = (float *)malloc(small * sizeof(float));
+	j.sums = (float *)malloc((size_t)j.sw * 4 * sizeof(float));
+	j.rows = (int16_t *)malloc((size_t)threads * ((size_t)j.sw * 4 + 4) * sizeof(int16_t));
+	uint16_t *col_x = (uint16_t *)malloc((size_t)j.W * sizeof(uint16_t));
+	uint8_t *col_w = (uint8_t *)malloc((size_t)j.W);
+	int ok = j.a && j.b && j.sums && j.rows && col_x && col_w;
+	if (ok) {
+		for (int x = 0; x < j.W; ++x) {
+			int at, w;
+			frost_source(x, j.sw, &at, &w);
+			col_x[x] = (uint16_t)at;
+			col_w[x] = (uint8_t)w;
+		}
+		j.col_x = col_x;
+		j.col_w = col_w;
+		cairo_surface_flush(img);
+		j.px = cairo_image_surface_get_data(img);
+		frost_parallel(frost_downsample, &j, j.sh, threads);
+		frost_parallel(frost_blur_rows, &j, j.sh, threads);
+		frost_parallel(frost_blur_cols, &j, j.sw, threads);
+		frost_parallel(frost_compose, &j, j.H, threads);
+		cairo_surface_mark_dirty(img);
+	}
+	free(j.a);
+	free(j.b);
+	free(j.sums);
+	free(j.rows);
+	free(col_x);
+	free(col_w);
+	return ok;
+}
+
+// --- Screenshot helper ---------------------------------------------------
+// Must match cairo_destroy_func_t (void (*)(void*))
+static void free_user_data(void *data)
+{
+	DBG("[piewin] Freeing screenshot buffer\n");
+	free(data);
+}
+
+// Expand packed B,G,R rows (src_stride bytes apart) to 32bpp in place.
+// Working back to front never overwrites bytes that are still to be read,
+// as long as the buffer holds W*H*4 bytes and src_stride <= W*4.
+static void expand_bgr24_in_place(uint8_t *buf, int W, int H, size_t src_stride)
+{
+	uint32_t *dst = (uint32_t *)buf;
+	for (int y = H - 1; y >= 0; --y) {
+		const uint8_t *row = buf + (size_t)y * src_stride;
+		uint32_t *drow = dst + (size_t)y * W;
+		for (int x = W - 1; x >= 0; --x) {
+			uint8_t B = row[x * 3 + 0];
+			uint8_t G = row[x * 3 + 1];
+			uint8_t R = row[x * 3 + 2];
+			drow[x] = ((uint32_t)R << 16) | ((uint32_t)G << 8) | (uint32_t)B;
+		}
+	}
+}
+
+// Wrap ZPixmap data (24 or 32 bpp, B,G,R order) as an RGB24 surface
+// without copying it. 24bpp rows are expanded in place, which needs room
+// for W*H*4 bytes at `pixels`: if `block` (the allocation holding the
+// pixels, e.g. the GetImage reply) is given it is grown with realloc and
+// freed together with the surface; otherwise the caller provides the room
+// and keeps ownership.
+static cairo_surface_t *screenshot_to_surface(void *block, uint8_t *pixels, uint32_t data_len, int W, int H)
+{
+	size_t stride = (size_t)W * 4;
+	size_t src_stride = (W > 0 && H > 0) ? data_len / (size_t)H : 0;
+	int bpp = (W > 0) ? (int)(src_stride / (size_t)W) : 0;
+
+	if (bpp == 4 && src_stride == stride) {
+		// Already 32bpp: use as is
+	} else if (bpp == 3) {
+		if (block) {
+			size_t off = (size_t)(pixels - (uint8_t *)block);
+			void *grown = realloc(block, off + stride * H);
+			if (!grown) {
+				DBG("[piewin] realloc failed for screenshot buffer\n");
+				free(block);
+				return NULL;
+			}
+			block = grown;
+			pixels = (uint8_t *)grown + off;
+		}
+		expand_bgr24_in_place(pixels, W, H, src_stride);
+	} else {
+		DBG("[piewin] Unsupported bpp=%d for screenshot; disabling.\n", bpp);
+		free(block);
+		return NULL;
+	}
+
+	static cairo_user_data_key_t KEY_FREE;
+	cairo_surface_t *img = cairo_image_surface_create_for_data(
+	    pixels, CAIRO_FORMAT_RGB24, W, H, (int)stride);
+	if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+		DBG("[piewin] cairo_image_surface_create_for_data failed\n");
+		cairo_surface_destroy(img);
+		free(block);
+		return NULL;
+	}
+	if (block) {
+		cairo_surface_set_user_data(img, &KEY_FREE, block, free_user_data);
+		DBG("[piewin] Screenshot surface wraps the reply buffer; user data hook set\n");
+	}
+	return img;
+}
+
+// Dim (or frost, see frost_apply) and draw cursor mark directly onto the
+// image once. frost may be NULL.
+static void dim_and_mark_screenshot(cairo_surface_t *img, int W, int H, int mouse_x, int mouse_y, int have_pos,
+                                    const FrostOpts *frost)
+{
+	int frosted = 0;
+	if (frost && frost->enabled) {
+		int64_t t = trace_begin();
+		frosted = frost_apply(img, frost);
+		trace_end("frost", t);
+		DBG("[piewin] Frosted background %s (%d threads)\n", frosted ? "applied" : "not possible; dimming",
+		    frost_threads(frost->threads));
+	}
+	cairo_t *tcr = cairo_create(img);
+	if (!frosted) {
+		// Dim brightness with translucent black
+		cairo_set_source_rgba(tcr, 0.0, 0.0, 0.0, FROST_DIM);
+		cairo_rectangle(tcr, 0, 0, W, H);
+		cairo_fill(tcr);
+	}
+
+	if (have_pos) {
+		double r = 16.0; // 32x32 diameter
+		double cx = (double)mouse_x;
+		double cy = (double)mouse_y;
+		DBG("[piewin] Drawing cursor marker at %d,%d\n", mouse_x, mouse_y);
+
+		// Soft halo
+		cairo_set_source_rgba(tcr, 0.0, 0.0, 0.0, 0.35);
+		cairo_arc(tcr, cx, cy, r + 3.0, 0, 2 * M_PI);
+		cairo_fill(tcr);
+
+		// Fill red
+		cairo_set_source_rgba(tcr, 1.0, 0.1, 0.1, 0.9);
+		cairo_arc(tcr, cx, cy, r, 0, 2 * M_PI);
+		cairo_fill(tcr);
+
+		// Outline
+		cairo_set_source_rgba(tcr, 1.0, 1.0, 1.0, 0.9);
+		cairo_set_line_width(tcr, 2.0);
+		cairo_arc(tcr, cx, cy, r, 0, 2 * M_PI);
+		cairo_stroke(tcr);
+	}
+	cairo_destroy(tcr);
+}
+
+static cairo_surface_t *capture_dimmed_screenshot_with_cursor(App *app, int mouse_x, int mouse_y, int have_pos)
+{
+	int W = app->width, H = app->height;
+	DBG("[piewin] Capturing screenshot of %dx%d (root=0x%08x)\n", W, H, (unsigned)app->screen->root);
+	xcb_get_image_cookie_t ck =
+	    xcb_get_image(app->conn, XCB_IMAGE_FORMAT_Z_PIXMAP, app->screen->root,
+	                  app->x, app->y, W, H, ~0u);
+	xcb_get_image_reply_t *rep = xstats_reply(xcb_get_image_reply(app->conn, ck, NULL));
+	if (!rep) {
+		DBG("[piewin] xcb_get_image failed; no background will be used.\n");
+		return NULL;
+	}
+	uint32_t data_len = xcb_get_image_data_length(rep);
+	xstats_image(data_len);
+	DBG("[piewin] Screenshot depth=%u data_len=%u\n", rep->depth, data_len);
+
+	// The reply becomes the surface's pixel buffer (no second frame copy),
+	// and dimming is applied to it in place.
+	cairo_surface_t *img = screenshot_to_surface(rep, xcb_get_image_data(rep), data_len, W, H);
+	if (!img) return NULL;
+	dim_and_mark_screenshot(img, W, H, mouse_x, mouse_y, have_pos, &app->frost);
+	return img;
+}
+
+// --- Server-side screenshot ----------------------------------------------
+// With a compositing manager the root window does not show the composited
+// picture; the Composite overlay window does.
+static int compositor_running(App *app, int scrno)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "_NET_WM_CM_S%d", scrno);
+	xcb_atom_t cm = intern_atom(app->conn, name, 1);
+	if (cm == XCB_NONE) return 0;
+	xcb_get_selection_owner_reply_t *r =
+	    xstats_reply(xcb_get_selection_owner_reply(app->conn, xcb_get_selection_owner(app->conn, cm), NULL));
+	int running = r && r->owner != XCB_NONE;
+	free(r);
+	return running;
+}
+
+static xcb_window_t composite_overlay_window(App *app)
+{
+	xcb_composite_query_version_reply_t *v =
+	    xstats_reply(xcb_composite_query_version_reply(app->conn, xcb_composite_query_version(app->conn, 0, 3), NULL));
+	if (!v) return XCB_NONE;
+	int ok = v->major_version > 0 || v->minor_version >= 3;
+	free(v);
+	if (!ok) return XCB_NONE;
+	xcb_composite_get_overlay_window_reply_t *r = xstats_reply(xcb_composite_get_overlay_window_reply(
+	    app->conn, xcb_composite_get_overlay_window(app->conn, app->screen->root), NULL));
+	xcb_window_t w = r ? r->overlay_win : XCB_NONE;
+	free(r);
+	return w;
+}
+
+// Copy the screen into a pixmap with CopyArea and dim it there. cairo's XCB
+// backend turns the dim and the marker into RENDER requests, so no screen
+// pixels are transferred to or from the client.
+static cairo_surface_t *capture_server_screenshot(App *app, int scrno, int mouse_x, int mouse_y, int have_pos)
+{
+	int W = app->width, H = app->height;
+	xcb_drawable_t src = app->screen->root;
+	xcb_window_t overlay = XCB_NONE;
+	if (compositor_running(app, scrno)) {
+		overlay = composite_overlay_window(app);
+		if (overlay != XCB_NONE) src = overlay;
+	}
+	DBG("[piewin] Server-side capture of %dx%d from 0x%08x%s\n", W, H, (unsigned)src,
+	    overlay != XCB_NONE ? " (composite overlay)" : "");
+
+	app->bg_pixmap = xcb_generate_id(app->conn);
+	xcb_create_pixmap(app->conn, app->screen->root_depth, app->bg_pixmap, app->screen->root, W, H);
+	xcb_gcontext_t gc = xcb_generate_id(app->conn);
+	uint32_t mode = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS;
+	xcb_create_gc(app->conn, gc, app->bg_pixmap, XCB_GC_SUBWINDOW_MODE, &mode);
+	xcb_copy_area(app->conn, src, app->bg_pixmap, gc, app->x, app->y, 0, 0, W, H);
+	xcb_free_gc(app->conn, gc);
+	if (overlay != XCB_NONE) xcb_composite_release_overlay_window(app->conn, app->screen->root);
+
+	xcb_visualtype_t *vt = find_visualtype(app->screen, app->screen->root_visual);
+	cairo_surface_t *img = cairo_xcb_surface_create(app->conn, app->bg_pixmap, vt, W, H);
+	if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+		DBG("[piewin] cairo_xcb_surface_create failed for screenshot pixmap\n");
+		cairo_surface_destroy(img);
+		xcb_free_pixmap(app->conn, app->bg_pixmap);
+		app->bg_pixmap = XCB_NONE;
+		return NULL;
+	}
+	// The pixels stay on the server, so --frosted falls back to the plain dim.
+	dim_and_mark_screenshot(img, W, H, mouse_x, mouse_y, have_pos, NULL);
+	cairo_surface_flush(img);
+	return img;
+}
+
+// --- Monitor geometry -----------------------------------------------------
+// RandR 1.5 monitor containing (px, py), else the primary, else the first.
+// Returns 0 (and leaves the outputs alone) without RandR 1.5.
+static int monitor_at(App *app, int px, int py, int *x, int *y, int *w, int *h)
+{
+	const xcb_query_extension_reply_t *ext = xcb_get_extension_data(app->conn, &xcb_randr_id);
+	if (!ext || !ext->present) return 0;
+	xcb_randr_query_version_cookie_t vc = xcb_randr_query_version(app->conn, 1, 5);
+	xcb_randr_get_monitors_cookie_t mc = xcb_randr_get_monitors(app->conn, app->screen->root, 1);
+	xcb_randr_query_version_reply_t *v = xstats_reply(xcb_randr_query_version_reply(app->conn, vc, NULL));
+	xcb_randr_get_monitors_reply_t *m = xstats_reply(xcb_randr_get_monitors_reply(app->conn, mc, NULL));
+	int ok = v && (v->major_version > 1 || v->minor_version >= 5) && m;
+	free(v);
+	if (!ok) {
+		free(m);
+		return 0;
+	}
+	const xcb_randr_monitor_info_t *pick = NULL, *primary = NULL, *first = NULL;
+	for (xcb_randr_monitor_info_iterator_t it = xcb_randr_get_monitors_monitors_iterator(m); it.rem;
+	     xcb_randr_monitor_info_next(&it)) {
+		const xcb_randr_monitor_info_t *mi = it.data;
+		if (!first) first = mi;
+		if (mi->primary && !primary) primary = mi;
+		if (!pick && px >= mi->x && px < mi->x + mi->width && py >= mi->y && py < mi->y + mi->height) pick = mi;
+	}
+	if (!pick) pick = primary ? primary : first;
+	if (pick) {
+		*x = pick->x;
+		*y = pick->y;
+		*w = pick->width;
+		*h = pick->height;
+	}
+	free(m);
+	return pick != NULL;
+}
+
+// --- XTEST typing helpers -------------------------------------------------
+static void fake_key(App *app, uint8_t press, xcb_keycode_t kc)
+{
+	DBG("[type] fake %s kc=%u\n", press ? "press" : "release", (unsigned)kc);
+	xcb_test_fake_input(app->conn, press ? XCB_KEY_PRESS : XCB_KEY_RELEASE,
+	                    kc, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+	xcb_flush(app->conn);
+	app->fake_events++;
+	sleep_us(TYPE_EVENT_DELAY_US);
+}
+
+static void refresh_active_group(App *app)
+{
+	app->active_group = 0;
+	if (!app->xkb_available) return;
+
+	xcb_xkb_get_state_cookie_t ck = xcb_xkb_get_state(app->conn, XCB_XKB_ID_USE_CORE_KBD);
+	xcb_xkb_get_state_reply_t *rep = xstats_reply(xcb_xkb_get_state_reply(app->conn, ck, NULL));
+	if (!rep) {
+		DBG("[type] xkb_get_state failed; using group 0\n");
+		return;
+	}
+
+	app->active_group = rep->group;
+	app->locked_group = rep->lockedGroup;
+	app->locked_mods = rep->lockedMods;
+	DBG("[type] Active keyboard group: %u (locked %u, locked mods 0x%02x)\n",
+	    (unsigned)app->active_group, (unsigned)app->locked_group, (unsigned)app->locked_mods);
+	free(rep);
+}
+
+static void init_xkb(App *app)
+{
+	app->xkb_available = 0;
+	xcb_xkb_use_extension_cookie_t ck = xcb_xkb_use_extension(app->conn,
+	                                                          XCB_XKB_MAJOR_VERSION,
+	                                                          XCB_XKB_MINOR_VERSION);
+	xcb_xkb_use_extension_reply_t *rep = xstats_reply(xcb_xkb_use_extension_reply(app->conn, ck, NULL));
+	if (!rep) {
+		DBG("[type] XKB use_extension reply failed; using group 0\n");
+		return;
+	}
+	if (!rep->supported) {
+		DBG("[type] XKB extension not supported; using group 0\n");
+		free(rep);
+		return;
+	}
+
+	app->xkb_available = 1;
+	free(rep);
+	refresh_active_group(app);
+}
+
+static void release_all_keys(App *app)
+{
+	// Defensive: release every keycode in the server-advertised range in case
+	// an event was dropped and a key is stuck repeating.
+	if (!app->conn) return;
+	if (app->min_keycode > app->max_keycode) return;
+
+	for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
+		xcb_test_fake_input(app->conn, XCB_KEY_RELEASE, kc,
+		                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+	}
+	xcb_flush(app->conn);
+}
+
+static void keysym_columns_for_group(App *app, xcb_keycode_t kc, int group, xcb_keysym_t *col0, xcb_keysym_t *col1)
+{
+	int base = group * 2;
+	*col0 = xcb_key_symbols_get_keysym(app->keysyms, kc, base);
+	*col1 = xcb_key_symbols_get_keysym(app->keysyms, kc, base + 1);
+
+	// If the requested group is out of range, fall back to group 0 mapping.
+	if (*col0 == XCB_NO_SYMBOL && *col1 == XCB_NO_SYMBOL && group != 0) {
+		*col0 = xcb_key_symbols_get_keysym(app->keysyms, kc, 0);
+		*col1 = xcb_key_symbols_get_keysym(app->keysyms, kc, 1);
+	}
+}
+
+// --- XKB keymap model ----------------------------------------------------
+static void xkbmap_free(XkbKeyMap *km)
+{
+	free(km->types);
+	free(km->syms);
+	memset(km, 0, sizeof(*km));
+}
+
+static int xkbmap_fetch(App *app)
+{
+	XkbKeyMap *km = &app->xkbmap;
+	xkbmap_free(km);
+	if (!app->xkb_available) return 0;
+
+	uint16_t parts = XCB_XKB_MAP_PART_KEY_TYPES | XCB_XKB_MAP_PART_KEY_SYMS | XCB_XKB_MAP_PART_MODIFIER_MAP;
+	xcb_xkb_get_map_cookie_t ck = xcb_xkb_get_map(app->conn, XCB_XKB_ID_USE_CORE_KBD, parts,
+	                                               0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	xcb_xkb_get_map_reply_t *rep = xstats_reply(xcb_xkb_get_map_reply(app->conn, ck, NULL));
+	if (!rep) {
+		DBG("[type] xkb_get_map failed; using core keymap\n");
+		return 0;
+	}
+	xcb_xkb_get_map_map_t map;
+	xcb_xkb_get_map_map_unpack(xcb_xkb_get_map_map(rep), rep->nTypes, rep->nKeySyms,
+	                           rep->nKeyActions, rep->totalActions, rep->totalKeyBehaviors,
+	                           rep->virtualMods, rep->totalKeyExplicit, rep->totalModMapKeys,
+	                           rep->totalVModMapKeys, rep->present, &map);
+
+	km->types = (XkbKeyType *)calloc(rep->nTypes ? rep->nTypes : 1, sizeof(XkbKeyType));
+	km->syms = (xcb_keysym_t *)calloc(rep->totalSyms ? rep->totalSyms : 1, sizeof(xcb_keysym_t));
+	if (!km->types || !km->syms) {
+		DBG("[type] calloc failed for XKB keymap\n");
+		xkbmap_free(km);
+		free(rep);
+		return 0;
+	}
+
+	xcb_xkb_key_type_iterator_t ti = xcb_xkb_get_map_map_types_rtrn_iterator(rep, &map);
+	for (int i = 0; ti.rem && i < rep->nTypes; ++i, xcb_xkb_key_type_next(&ti)) {
+		XkbKeyType *t = &km->types[i];
+		t->mask = ti.data->mods_mask;
+		t->num_levels = ti.data->numLevels;
+		const xcb_xkb_kt_map_entry_t *e = xcb_xkb_key_type_map(ti.data);
+		int ne = xcb_xkb_key_type_map_length(ti.data);
+		for (int j = 0; j < ne && t->n_entries < XKB_MAX_TYPE_ENTRIES; ++j) {
+			// Entries bound to unbound virtual modifiers are inactive.
+			if (!e[j].active) continue;
+			t->entries[t->n_entries].mods = e[j].mods_mask;
+			t->entries[t->n_entries].level = e[j].level;
+			t->n_entries++;
+		}
+		km->n_types = i + 1;
+	}
+
+	uint32_t off = 0;
+	xcb_xkb_key_sym_map_iterator_t si = xcb_xkb_get_map_map_syms_rtrn_iterator(rep, &map);
+	for (int i = 0; si.rem && i < rep->nKeySyms; ++i, xcb_xkb_key_sym_map_next(&si)) {
+		int kc = rep->firstKeySym + i;
+		const xcb_xkb_key_sym_map_t *sm = si.data;
+		int n = xcb_xkb_key_sym_map_syms_length(sm);
+		if (kc > 255 || off + (uint32_t)n > rep->totalSyms) break;
+		XkbKey *k = &km->keys[kc];
+		k->sym_off = off;
+		k->n_syms = (uint16_t)n;
+		k->n_groups = sm->groupInfo & 0x0F;
+		if (k->n_groups > 4) k->n_groups = 4;
+		k->group_info = sm->groupInfo;
+		k->width = sm->width;
+		memcpy(k->kt, sm->kt_index, sizeof(k->kt));
+		memcpy(km->syms + off, xcb_xkb_key_sym_map_syms(sm), (size_t)n * sizeof(xcb_keysym_t));
+		off += (uint32_t)n;
+		if (k->n_groups > km->n_groups) km->n_groups = k->n_groups;
+	}
+
+	xcb_xkb_key_mod_map_iterator_t mi = xcb_xkb_get_map_map_modmap_rtrn_iterator(rep, &map);
+	for (; mi.rem; xcb_xkb_key_mod_map_next(&mi))
+		km->modmap[mi.data->keycode] = mi.data->mods;
+
+	DBG("[type] XKB keymap: %d types, %u keysyms, %d groups\n", km->n_types, off, km->n_groups);
+	free(rep);
+	km->valid = 1;
+	return 1;
+}
+
+// Group a key actually uses when the keyboard is in `group`, following the
+// key's out-of-range rule (wrap, clamp or redirect).
+static int xkbmap_effective_group(const XkbKey *k, int group)
+{
+	if (k->n_groups == 0) return -1;
+	if (group < k->n_groups) return group;
+	switch (k->group_info & 0xC0) {
+		case 0x40: return k->n_groups - 1;
+		case 0x80:
+			{
+				int g = (k->group_info >> 4) & 0x03;
+				return (g < k->n_groups) ? g : 0;
+			}
+		default: return group % k->n_groups;
+	}
+}
+
+static int xkbmap_level_for_mods(const XkbKeyType *t, uint8_t mods)
+{
+	uint8_t m = mods & t->mask;
+	for (int i = 0; i < t->n_entries; ++i) {
+		if (t->entries[i].mods == m) return t->entries[i].level;
+	}
+	return 0;
+}
+
+static const XkbKeyType *xkbmap_key_type(const XkbKeyMap *km, const XkbKey *k, int eg)
+{
+	int ti = k->kt[eg & 3];
+	return (ti < km->n_types) ? &km->types[ti] : NULL;
+}
+
+static xcb_keysym_t xkbmap_keysym(const XkbKeyMap *km, xcb_keycode_t kc, int group, uint8_t mods)
+{
+	const XkbKey *k = &km->keys[kc];
+	int eg = xkbmap_effective_group(k, group);
+	if (eg < 0) return XCB_NO_SYMBOL;
+	const XkbKeyType *t = xkbmap_key_type(km, k, eg);
+	int level = t ? xkbmap_level_for_mods(t, mods) : 0;
+	int i = eg * k->width + level;
+	return (level < k->width && i < k->n_syms) ? km->syms[k->sym_off + i] : XCB_NO_SYMBOL;
+}
+
+static int is_lock_keysym(xcb_keysym_t sym)
+{
+	return sym == 0xffe5     // Caps_Lock
+	       || sym == 0xffe6  // Shift_Lock
+	       || sym == 0xff7f  // Num_Lock
+	       || sym == 0xff14  // Scroll_Lock
+	       || sym == 0xfe04  // ISO_Level3_Lock
+	       || sym == 0xfe13; // ISO_Level5_Lock
+}
+
+// --- Keysym reverse index ------------------------------------------------
+#define KEYIDX_MAX_GROUPS 4
+
+static uint32_t keyidx_hash(xcb_keysym_t sym, int group)
+{
+	uint32_t h = (uint32_t)sym * 0x9E3779B1u;
+	h ^= (uint32_t)group * 0x85EBCA6Bu;
+	return h ^ (h >> 16);
+}
+
+static void keyidx_free(KeyIndex *ki)
+{
+	free(ki->slots);
+	memset(ki, 0, sizeof(*ki));
+}
+
+static void keyidx_invalidate(KeyIndex *ki)
+{
+	if (ki->valid) DBG("[type] Keymap index invalidated\n");
+	ki->valid = 0;
+}
+
+// First writer wins; callers insert in order of preference.
+static void keyidx_insert(KeyIndex *ki, xcb_keysym_t sym, int group, xcb_keycode_t kc, int level, int kt)
+{
+	if (sym == XCB_NO_SYMBOL) return;
+	uint32_t i = keyidx_hash(sym, group) & ki->mask;
+	for (;; i = (i + 1) & ki->mask) {
+		KeyIndexSlot *s = &ki->slots[i];
+		if (!s->kc) {
+			s->sym = sym;
+			s->group = (uint8_t)group;
+			s->level = (uint8_t)level;
+			s->kt = (uint8_t)kt;
+			s->kc = kc;
+			return;
+		}
+		if (s->sym == sym && s->group == group) return;
+	}
+}
+
+static const KeyIndexSlot *keyidx_lookup(const KeyIndex *ki, xcb_keysym_t sym, int group)
+{
+	if (!ki->slots) return NULL;
+	uint32_t i = keyidx_hash(sym, group) & ki->mask;
+	for (;; i = (i + 1) & ki->mask) {
+		const KeyIndexSlot *s = &ki->slots[i];
+		if (!s->kc) return NULL;
+		if (s->sym == sym && s->group == group) return s;
+	}
+}
+
+static int is_spare_keycode(const SpareKeys *sk, xcb_keycode_t kc)
+{
+	for (int i = 0; i < sk->n; ++i) {
+		if (sk->kc[i] == kc) return 1;
+	}
+	return 0;
+}
+
+// Core keymap: only the two columns of each group, level 1 means Shift.
+// Ascending keycodes and col0 before col1 keep the preference order of the
+// old per-character xcb_key_symbols_get_keycode scan.
+static void keyidx_fill_core(App *app)
+{
+	KeyIndex *ki = &app->keyidx;
+	for (int group = 0; group < KEYIDX_MAX_GROUPS; ++group) {
+		for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
+			if (is_spare_keycode(&app->spare, (xcb_keycode_t)kc)) continue;
+			xcb_keysym_t col0 = 0, col1 = 0;
+			keysym_columns_for_group(app, (xcb_keycode_t)kc, group, &col0, &col1);
+			keyidx_insert(ki, col0, group, (xcb_keycode_t)kc, 0, KEYIDX_CORE_TYPE);
+			keyidx_insert(ki, col1, group, (xcb_keycode_t)kc, 1, KEYIDX_CORE_TYPE);
+		}
+	}
+	ki->n_groups = 1;
+	const KeyIndexSlot *s;
+	ki->mod_kc[0] = (s = keyidx_lookup(ki, XK_Shift_L, 0)) ? s->kc : 0;
+	ki->mod_kc[2] = (s = keyidx_lookup(ki, XK_Control_L, 0)) ? s->kc : 0;
+}
+
+// XKB keymap: every level of every group, lower levels first so the
+// fewest modifiers win, then ascending keycodes.
+static void keyidx_fill_xkb(App *app)
+{
+	KeyIndex *ki = &app->keyidx;
+	const XkbKeyMap *km = &app->xkbmap;
+	int max_width = 0;
+	for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
+		if (km->keys[kc].width > max_width) max_width = km->keys[kc].width;
+	}
+
+	for (int group = 0; group < km->n_groups; ++group) {
+		for (int level = 0; level < max_width; ++level) {
+			for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
+				if (is_spare_keycode(&app->spare, (xcb_keycode_t)kc)) continue;
+				const XkbKey *k = &km->keys[kc];
+				int eg = xkbmap_effective_group(k, group);
+				if (eg < 0 || level >= k->width) continue;
+				int kt = k->kt[eg];
+				if (kt >= km->n_types || level >= km->types[kt].num_levels) continue;
+				int i = eg * k->width + level;
+				if (i >= k->n_syms) continue;
+				keyidx_insert(ki, km->syms[k->sym_off + i], group, (xcb_keycode_t)kc, level, kt);
+			}
+		}
+	}
+	ki->n_groups = km->n_groups;
+
+	// A modifier is set by any key carrying it in the modifier map, but
+	// never use a lock key (pressing Caps_Lock would toggle, not hold).
+	for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
+		uint8_t mods = km->modmap[kc];
+		if (!mods || is_lock_keysym(xkbmap_keysym(km, (xcb_keycode_t)kc, 0, 0))) continue;
+		for (int bit = 0; bit < 8; ++bit) {
+			if ((mods & (1u << bit)) && !ki->mod_kc[bit]) ki->mod_kc[bit] = (xcb_keycode_t)kc;
+		}
+	}
+}
+
+static int keyidx_build(App *app)
+{
+	KeyIndex *ki = &app->keyidx;
+	int nkeys = (int)app->max_keycode - (int)app->min_keycode + 1;
+	if (nkeys <= 0) return 0;
+
+	int64_t t0 = monotonic_ns();
+	int use_xkb = app->xkb_available && xkbmap_fetch(app);
+	int max_width = 2;
+	if (use_xkb) {
+		for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
+			if (app->xkbmap.keys[kc].width > max_width) max_width = app->xkbmap.keys[kc].width;
+		}
+	}
+
+	// At most max_width entries per key and group; keep load factor <= 0.5.
+	uint32_t cap = 64;
+	while (cap < (uint32_t)nkeys * KEYIDX_MAX_GROUPS * (uint32_t)max_width * 2)
+		cap <<= 1;
+	if (!ki->slots || ki->mask + 1 != cap) {
+		free(ki->slots);
+		ki->slots = (KeyIndexSlot *)calloc(cap, sizeof(KeyIndexSlot));
+		if (!ki->slots) {
+			DBG("[type] calloc failed for keymap index\n");
+			ki->mask = 0;
+			ki->valid = 0;
+			return 0;
+		}
+		ki->mask = cap - 1;
+	} else {
+		memset(ki->slots, 0, (size_t)cap * sizeof(KeyIndexSlot));
+	}
+	memset(ki->mod_kc, 0, sizeof(ki->mod_kc));
+
+	if (use_xkb)
+		keyidx_fill_xkb(app);
+	else
+		keyidx_fill_core(app);
+
+	ki->valid = 1;
+	DBG("[type] Built %s keymap index: %d keycodes, %d groups, %u slots in %.3fms\n",
+	    use_xkb ? "XKB" : "core", nkeys, ki->n_groups, cap, (double)(monotonic_ns() - t0) / 1e6);
+	return 1;
+}
+
+// Pick up MappingNotify events that arrived while typing; they mean the
+// cached key symbols and the index are stale.
+static void keyidx_poll_mapping_changes(App *app)
+{
+	xcb_generic_event_t *ev;
+	while ((ev = xcb_poll_for_event(app->conn))) {
+		if ((ev->response_type & ~0x80) == XCB_MAPPING_NOTIFY) {
+			xcb_refresh_keyboard_mapping(app->keysyms, (xcb_mapping_notify_event_t *)ev);
+			keyidx_invalidate(&app->keyidx);
+		}
+		free(ev);
+	}
+}
+
+static const KeyIndexSlot *keycode_for_keysym(App *app, xcb_keysym_t sym, int group)
+{
+	if (!app->keyidx.valid && !keyidx_build(app)) return NULL;
+	return keyidx_lookup(&app->keyidx, sym, group);
+}
+
+// Keysym lookup in the active group first, then in any other group the
+// keymap has (XKB only; typing there needs a group switch).
+static const KeyIndexSlot *find_key_for_keysym(App *app, xcb_keysym_t sym, int *group)
+{
+	*group = app->active_group;
+	const KeyIndexSlot *s = keycode_for_keysym(app, sym, app->active_group);
+	if (s || !app->xkb_available) return s;
+	for (int g = 0; g < app->keyidx.n_groups; ++g) {
+		if (g == app->active_group) continue;
+		if ((s = keyidx_lookup(&app->keyidx, sym, g))) {
+			*group = g;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+// Real modifiers to hold so the key lands on the slot's level, taking the
+// currently locked modifiers into account. -1 if the level is unreachable
+// without toggling a lock.
+static int keyidx_slot_mods(const App *app, const KeyIndexSlot *s)
+{
+	if (s->kt == KEYIDX_CORE_TYPE) return s->level ? XCB_MOD_MASK_SHIFT : 0;
+
+	const XkbKeyType *t = &app->xkbmap.types[s->kt];
+	uint8_t locked = app->locked_mods;
+	if (xkbmap_level_for_mods(t, locked) == s->level) return 0;
+	int best = -1, best_bits = 9;
+	for (int i = 0; i < t->n_entries; ++i) {
+		uint8_t m = t->entries[i].mods & (uint8_t)~locked;
+		if (m & XCB_MOD_MASK_LOCK) continue;
+		if (xkbmap_level_for_mods(t, m | locked) != s->level) continue;
+		int bits = __builtin_popcount(m);
+		if (bits < best_bits) {
+			best = m;
+			best_bits = bits;
+		}
+	}
+	return best;
+}
+
+static void lock_group(App *app, int group)
+{
+	DBG("[type] Locking group %d (was %u)\n", group, (unsigned)app->active_group);
+	xcb_xkb_latch_lock_state(app->conn, XCB_XKB_ID_USE_CORE_KBD, 0, 0, 1, (uint8_t)group, 0, 0, 0);
+	app->active_group = (uint8_t)group;
+	app->group_locked = 1;
+}
+
+static void restore_group(App *app)
+{
+	if (!app->group_locked) return;
+	DBG("[type] Restoring group lock %u\n", (unsigned)app->locked_group);
+	xcb_xkb_latch_lock_state(app->conn, XCB_XKB_ID_USE_CORE_KBD, 0, 0, 1, app->locked_group, 0, 0, 0);
+	xcb_flush(app->conn);
+	app->group_locked = 0;
+	refresh_active_group(app);
+}
+
+// Press the slot's key with the modifiers its level needs (Shift, AltGr,
+// ...), switching the group lock first if the keysym lives elsewhere.
+static int send_keysym(App *app, xcb_keysym_t sym)
+{
+	int group;
+	const KeyIndexSlot *s = find_key_for_keysym(app, sym, &group);
+	if (!s) {
+		DBG("[type] No keycode for keysym 0x%08x\n", (unsigned)sym);
+		return 0;
+	}
+	xcb_keycode_t kc = s->kc;
+	int mods = keyidx_slot_mods(app, s);
+	DBG("[type] group=%d sym=0x%08x kc=%u level=%u mods=0x%02x\n",
+	    group, (unsigned)sym, (unsigned)kc, (unsigned)s->level, (unsigned)mods);
+	if (mods < 0) return 0;
+
+	xcb_keycode_t held[8];
+	int nheld = 0;
+	for (int bit = 0; bit < 8; ++bit) {
+		if (!(mods & (1 << bit))) continue;
+		if (!app->keyidx.mod_kc[bit]) {
+			DBG("[type] No key for modifier bit %d; cannot reach level\n", bit);
+			return 0;
+		}
+		held[nheld++] = app->keyidx.mod_kc[bit];
+	}
+
+	if (group != app->active_group) lock_group(app, group);
+	for (int i = 0; i < nheld; ++i)
+		fake_key(app, 1, held[i]);
+	fake_key(app, 1, kc);
+	fake_key(app, 0, kc);
+	for (int i = nheld - 1; i >= 0; --i)
+		fake_key(app, 0, held[i]);
+	return 1;
+}
+
+static int unicode_hex_input(App *app, uint32_t cp)
+{
+	DBG("[type] unicode_hex_input U+%04X\n", cp);
+	// Ctrl+Shift+u, then hex digits, then Return
+	if (!app->keyidx.valid) keyidx_build(app);
+	xcb_keycode_t ctrl_kc  = app->keyidx.mod_kc[2];
+	xcb_keycode_t shift_kc = app->keyidx.mod_kc[0];
+	if (!ctrl_kc || !shift_kc) {
+		DBG("[type] Missing modifier keycodes for Ctrl/Shift\n");
+		return 0;
+	}
+
+	// Press Ctrl+Shift
+	fake_key(app, 1, ctrl_kc);
+	fake_key(app, 1, shift_kc);
+
+	// Press 'u'
+	if (!send_keysym(app, 'u')) {
+		DBG("[type] Could not send 'u' for Unicode preinput\n");
+	}
+
+	// Release modifiers
+	fake_key(app, 0, shift_kc);
+	fake_key(app, 0, ctrl_kc);
+
+	// Type lowercase hex
+	char hex[9];
+	snprintf(hex, sizeof(hex), "%x", cp);
+	for (char *p = hex; *p; ++p) {
+		if (!send_keysym(app, (xcb_keysym_t)*p)) {
+			DBG("[type] Failed sending hex digit '%c'\n", *p);
+		}
+	}
+
+	// Commit
+	if (!send_keysym(app, XK_Return)) {
+		DBG("[type] Failed sending Return to commit Unicode\n");
+	}
+	return 1;
+}
+
+// --- UTF-8 helpers ------------------------------------------------------
+// Decode one UTF-8 sequence into *cp and return its length in bytes.
+// Invalid bytes yield U+FFFD and consume a single byte.
+static int utf8_decode(const unsigned char *p, uint32_t *cp)
+{
+	if (p[0] < 0x80) {
+		*cp = p[0];
+		return 1;
+	}
+	if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+		*cp = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+		return 2;
+	}
+	if ((p[0] & 0xF0) == 0xE0 &&
+	    (p[1] & 0xC0) == 0x80 &&
+	    (p[2] & 0xC0) == 0x80) {
+		*cp = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+		return 3;
+	}
+	if ((p[0] & 0xF8) == 0xF0 &&
+	    (p[1] & 0xC0) == 0x80 &&
+	    (p[2] & 0xC0) == 0x80 &&
+	    (p[3] & 0xC0) == 0x80) {
+		*cp = ((uint32_t)(p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+		return 4;
+	}
+	*cp = 0xFFFD;
+	return 1;
+}
+
+// Keysym that produces code point cp, or XCB_NO_SYMBOL for control
+// characters that have no sensible key.
+static xcb_keysym_t keysym_for_codepoint(uint32_t cp)
+{
+	if (cp == '\n') return XK_Return;
+	if (cp == '\t') return XK_Tab;
+	if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) return XCB_NO_SYMBOL;
+	if (cp <= 0xFF) return (xcb_keysym_t)cp;  // ASCII and Latin-1 keysyms match
+	if (cp > 0x10FFFF) return XCB_NO_SYMBOL;
+	return (xcb_keysym_t)(0x01000000u | cp);  // Unicode keysym
+}
+
+// Legacy Cyrillic keysyms 0x6a1..0x6ff (keysymdef.h) to Unicode.
+static const uint16_t cyrillic_keysym_cp[] = {
+	0x0452, 0x0453, 0x0451, 0x0454, 0x0455, 0x0456, 0x0457, 0x0458,  // 0x6a1
+	0x0459, 0x045A, 0x045B, 0x045C, 0x0491, 0x045E, 0x045F, 0x2116,  // 0x6a9
+	0x0402, 0x0403, 0x0401, 0x0404, 0x0405, 0x0406, 0x0407, 0x0408,  // 0x6b1
+	0x0409, 0x040A, 0x040B, 0x040C, 0x0490, 0x040E, 0x040F,          // 0x6b9
+	0x044E, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433,  // 0x6c0
+	0x0445, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E,  // 0x6c8
+	0x043F, 0x044F, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432,  // 0x6d0
+	0x044C, 0x044B, 0x0437, 0x0448, 0x044D, 0x0449, 0x0447, 0x044A,  // 0x6d8
+};
+
+// Code point produced by keysym, or 0 for keys that do not produce text.
+static uint32_t keysym_to_codepoint(xcb_keysym_t sym)
+{
+	if (sym == XK_Return || sym == XK_KP_Enter) return '\n';
+	if (sym == XK_Tab) return '\t';
+	if ((sym >= 0x20 && sym <= 0x7E) || (sym >= 0xA0 && sym <= 0xFF)) return sym;
+	if (sym >= 0x01000100 && sym <= 0x0110FFFF) return sym & 0x00FFFFFF;
+	if (sym >= 0x6a1 && sym <= 0x6df) return cyrillic_keysym_cp[sym - 0x6a1];
+	if (sym >= 0x6e0 && sym <= 0x6ff) return cyrillic_keysym_cp[sym - 0x20 - 0x6a1] - 0x20;
+	if (sym == 0x20ac) return 0x20AC;  // EuroSign
+	return 0;
+}
+
+// Legacy keysym layouts use for cp instead of its Unicode keysym (the
+// Cyrillic block, EuroSign), or XCB_NO_SYMBOL.
+static xcb_keysym_t legacy_keysym_for_codepoint(uint32_t cp)
+{
+	if (cp == 0x20AC) return 0x20ac;
+	if (!((cp >= 0x0400 && cp <= 0x04FF) || cp == 0x2116)) return XCB_NO_SYMBOL;
+	int n = (int)(sizeof(cyrillic_keysym_cp) / sizeof(cyrillic_keysym_cp[0]));
+	for (int i = 0; i < n; ++i) {
+		if (cyrillic_keysym_cp[i] == cp) return (xcb_keysym_t)(0x6a1 + i);
+		if (0x6a1 + i >= 0x6c0 && (uint32_t)cyrillic_keysym_cp[i] - 0x20 == cp) return (xcb_keysym_t)(0x6a1 + i + 0x20);
+	}
+	return XCB_NO_SYMBOL;
+}
+
+// Whether cp can be typed from the layout in any group.
+static int codepoint_on_layout(App *app, uint32_t cp)
+{
+	int group;
+	xcb_keysym_t sym = keysym_for_codepoint(cp);
+	xcb_keysym_t legacy = legacy_keysym_for_codepoint(cp);
+	return (sym != XCB_NO_SYMBOL && find_key_for_keysym(app, sym, &group))
+	       || (legacy != XCB_NO_SYMBOL && find_key_for_keysym(app, legacy, &group));
+}
+
+// --- Spare keycode remapping ---------------------------------------------
+static void spare_keys_probe(App *app)
+{
+	SpareKeys *sk = &app->spare;
+	if (sk->probed) return;
+	sk->probed = 1;
+	sk->n = 0;
+
+	uint8_t count = (uint8_t)(app->max_keycode - app->min_keycode + 1);
+	xcb_get_keyboard_mapping_cookie_t ck = xcb_get_keyboard_mapping(app->conn, app->min_keycode, count);
+	xcb_get_keyboard_mapping_reply_t *rep = xstats_reply(xcb_get_keyboard_mapping_reply(app->conn, ck, NULL));
+	if (!rep) {
+		DBG("[type] get_keyboard_mapping failed; no spare keycodes\n");
+		return;
+	}
+	const xcb_keysym_t *syms = xcb_get_keyboard_mapping_keysyms(rep);
+	int per = rep->keysyms_per_keycode;
+	int nsyms = xcb_get_keyboard_mapping_keysyms_length(rep);
+	for (int i = 0; i < count && sk->n < TYPE_REMAP_MAX_KEYS; ++i) {
+		if ((i + 1) * per > nsyms) break;
+		int empty = 1;
+		for (int j = 0; j < per; ++j) {
+			if (syms[i * per + j] != XCB_NO_SYMBOL) {
+				empty = 0;
+				break;
+			}
+		}
+		if (empty) {
+			sk->kc[sk->n] = (xcb_keycode_t)(app->min_keycode + i);
+			sk->sym[sk->n] = XCB_NO_SYMBOL;
+			sk->n++;
+		}
+	}
+	free(rep);
+	DBG("[type] Found %d spare keycodes\n", sk->n);
+	// Spare keycodes are excluded from the index from now on.
+	keyidx_invalidate(&app->keyidx);
+}
+
+// Push the bindings of all slots whose symbol changed. Each run of
+// consecutive keycodes goes out as a single ChangeKeyboardMapping so
+// clients see as few MappingNotify events as possible.
+static void spare_keys_commit(App *app, const xcb_keysym_t *want)
+{
+	SpareKeys *sk = &app->spare;
+	int changed = 0;
+	for (int i = 0; i < sk->n;) {
+		int j = i + 1;
+		while (j < sk->n && sk->kc[j] == sk->kc[j - 1] + 1)
+			++j;
+
+		int run_changed = 0;
+		for (int k = i; k < j; ++k)
+			run_changed |= (want[k] != sk->sym[k]);
+		if (run_changed && sk->pressed) {
+			// Let keys already sent on the old bindings be translated
+			// before rebinding their keycodes.
+			xcb_flush(app->conn);
+			sleep_ms(TYPE_REMAP_SETTLE_MS);
+			sk->pressed = 0;
+		}
+		if (run_changed) {
+			// Two columns per keycode, same symbol unshifted and shifted.
+			xcb_keysym_t syms[TYPE_REMAP_MAX_KEYS * 2];
+			for (int k = i; k < j; ++k) {
+				syms[(k - i) * 2 + 0] = want[k];
+				syms[(k - i) * 2 + 1] = want[k];
+				sk->sym[k] = want[k];
+			}
+			xcb_change_keyboard_mapping(app->conn, (uint8_t)(j - i), sk->kc[i], 2, syms);
+			changed = 1;
+		}
+		i = j;
+	}
+	if (!changed) return;
+
+	// Round trip so the server has applied the mapping, then give clients a
+	// moment to process MappingNotify before keys arrive on the new codes.
+	xcb_get_input_focus_reply_t *fr = xstats_reply(xcb_get_input_focus_reply(app->conn, xcb_get_input_focus(app->conn), NULL));
+	free(fr);
+	sleep_ms(TYPE_REMAP_SETTLE_MS);
+	sk->dirty = 1;
+}
+
+static int spare_keys_find(const SpareKeys *sk, xcb_keysym_t sym)
+{
+	for (int i = 0; i < sk->n; ++i) {
+		if (sk->sym[i] == sym) return i;
+	}
+	return -1;
+}
+
+// Bind the keysyms of the next unmapped characters starting at p (which
+// must itself need a spare keycode) in one batch.
+static void spare_keys_bind_ahead(App *app, const unsigned char *p)
+{
+	SpareKeys *sk = &app->spare;
+	xcb_keysym_t want[TYPE_REMAP_MAX_KEYS];
+	int nwant = 0;
+
+	while (*p && nwant < sk->n) {
+		uint32_t cp;
+		p += utf8_decode(p, &cp);
+		xcb_keysym_t sym = keysym_for_codepoint(cp);
+		if (sym == XCB_NO_SYMBOL) continue;
+		if (codepoint_on_layout(app, cp)) continue;
+		int dup = 0;
+		for (int i = 0; i < nwant && !dup; ++i)
+			dup = (want[i] == sym);
+		if (!dup) want[nwant++] = sym;
+	}
+
+	// Keep symbols that are already bound and still needed in their slot,
+	// fill the remaining slots with the new ones.
+	xcb_keysym_t next[TYPE_REMAP_MAX_KEYS];
+	int used[TYPE_REMAP_MAX_KEYS] = {0};
+	for (int i = 0; i < sk->n; ++i) {
+		next[i] = XCB_NO_SYMBOL;
+		for (int w = 0; w < nwant; ++w) {
+			if (!used[w] && sk->sym[i] == want[w]) {
+				next[i] = want[w];
+				used[w] = 1;
+				break;
+			}
+		}
+	}
+	for (int w = 0, i = 0; w < nwant; ++w) {
+		if (used[w]) continue;
+		while (i < sk->n && next[i] != XCB_NO_SYMBOL)
+			++i;
+		if (i >= sk->n) break;
+		next[i] = want[w];
+	}
+	DBG("[type] Binding %d keysyms to spare keycodes\n", nwant);
+	spare_keys_commit(app, next);
+}
+
+static int send_keysym_via_spare(App *app, xcb_keysym_t sym, const unsigned char *p)
+{
+	SpareKeys *sk = &app->spare;
+	spare_keys_probe(app);
+	if (sk->n == 0) return 0;
+
+	int slot = spare_keys_find(sk, sym);
+	if (slot < 0) {
+		spare_keys_bind_ahead(app, p);
+		slot = spare_keys_find(sk, sym);
+		if (slot < 0) return 0;
+	}
+	DBG("[type] sym=0x%08x via spare kc=%u\n", (unsigned)sym, (unsigned)sk->kc[slot]);
+	fake_key(app, 1, sk->kc[slot]);
+	fake_key(app, 0, sk->kc[slot]);
+	sk->pressed = 1;
+	return 1;
+}
+
+static void spare_keys_restore(App *app)
+{
+	SpareKeys *sk = &app->spare;
+	if (!sk->dirty) return;
+	// spare_keys_commit() lets the last remapped keys be translated first.
+	xcb_keysym_t none[TYPE_REMAP_MAX_KEYS] = {0};
+	spare_keys_commit(app, none);
+	sk->dirty = 0;
+	DBG("[type] Restored spare keycodes\n");
+}
+
+static void type_utf8_string(App *app, const char *s)
+{
+	if (!s) return;
+
+	refresh_active_group(app);
+	DBG("[type] Typing with active group %u\n", (unsigned)app->active_group);
+
+	// One index build per typing session; each character is then a single
+	// hash lookup instead of a full keymap scan.
+	keyidx_poll_mapping_changes(app);
+	if (!app->keyidx.valid) keyidx_build(app);
+
+	// Query XTEST just for logging
+	xcb_test_get_version_cookie_t vck = xcb_test_get_version(app->conn, 2, 2);
+	xcb_test_get_version_reply_t *vrep = xstats_reply(xcb_test_get_version_reply(app->conn, vck, NULL));
+	if (vrep) {
+		DBG("[type] XTEST version %u.%u\n", vrep->major_version, vrep->minor_version);
+		free(vrep);
+	} else {
+		DBG("[type] XTEST version query failed\n");
+	}
+
+	DBG("[type] Typing string: \"%s\"\n", s);
+
+	const unsigned char *p = (const unsigned char *)s;
+	while (*p) {
+		uint32_t cp;
+		int len = utf8_decode(p, &cp);
+		DBG("[type] sending U+%04X\n", cp);
+
+		keyidx_poll_mapping_changes(app);
+
+		// Layout first (any level or group, legacy keysym as a fallback),
+		// then a temporarily bound spare keycode, then Unicode hex input as
+		// the last resort.
+		int sent = 0;
+		xcb_keysym_t sym = keysym_for_codepoint(cp);
+		if (sym != XCB_NO_SYMBOL) {
+			xcb_keysym_t legacy = legacy_keysym_for_codepoint(cp);
+			sent = send_keysym(app, sym);
+			if (!sent && legacy != XCB_NO_SYMBOL) sent = send_keysym(app, legacy);
+			if (!sent && app->type_remap) sent = send_keysym_via_spare(app, sym, p);
+		}
+		if (!sent && cp != '\n' && cp != '\t') sent = unicode_hex_input(app, cp);
+
+		if (!sent) DBG("[type] Failed to send U+%04X; skipping\n", cp);
+
+		p += len;
+	}
+	spare_keys_restore(app);
+	xcb_flush(app->conn);
+	release_all_keys(app);
+	restore_group(app);
+}
+
+// --- Focus handoff -------------------------------------------------------
+// w is anc or lies below it (root excluded).
+static int window_within(App *app, xcb_window_t w, xcb_window_t anc)
+{
+	while (w != XCB_NONE && w != app->screen->root) {
+		if (w == anc) return 1;
+		xcb_query_tree_reply_t *t = xstats_reply(xcb_query_tree_reply(app->conn, xcb_query_tree(app->conn, w), NULL));
+		if (!t) return 0;
+		w = t->parent;
+		free(t);
+	}
+	return 0;
+}
+
+// Focus has returned once the window that had it before we mapped holds it
+// again, or one of its ancestors (a WM frame) or descendants. With loose
+// set, any real window other than ours counts: the WM announced a new
+// active window, or it is taking long. If the focus was on the root (or
+// nowhere) before, nothing needs to come back.
+static int focus_returned(App *app, xcb_window_t prev_focus, int loose)
+{
+	int prev_real = prev_focus != XCB_NONE && prev_focus != XCB_INPUT_FOCUS_POINTER_ROOT
+	                && prev_focus != app->screen->root;
+	xcb_get_input_focus_reply_t *r =
+	    xstats_reply(xcb_get_input_focus_reply(app->conn, xcb_get_input_focus(app->conn), NULL));
+	if (!r) return 1;
+	xcb_window_t f = r->focus;
+	free(r);
+	if (!prev_real) return f != app->win;
+	if (f == XCB_NONE || f == XCB_INPUT_FOCUS_POINTER_ROOT || f == app->screen->root || f == app->win) return 0;
+	return loose || window_within(app, f, prev_focus) || window_within(app, prev_focus, f);
+}
+
+// Wait until our (already destroyed) window has handed focus back, woken by
+// _NET_ACTIVE_WINDOW changes on the root and a short GetInputFocus poll for
+// window managers that do not maintain it. Any real window is accepted
+// after _NET_ACTIVE_WINDOW changed or half of timeout_ms; gives up after
+// timeout_ms.
+static void wait_for_focus_return(App *app, xcb_window_t prev_focus, int timeout_ms)
+{
+	int64_t t0 = monotonic_ns();
+	int64_t deadline_ns = t0 + (int64_t)timeout_ms * 1000000LL;
+	xcb_atom_t net_active = intern_atom(app->conn, "_NET_ACTIVE_WINDOW", 1);
+	if (net_active != XCB_NONE) {
+		uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+		xcb_change_window_attributes(app->conn, app->screen->root, XCB_CW_EVENT_MASK, &mask);
+	}
+	int xfd = xcb_get_file_descriptor(app->conn);
+
+	int ok = 0, active_changed = 0;
+	int64_t loose_ns = t0 + (int64_t)timeout_ms * 500000LL;
+	for (;;) {
+		if (focus_returned(app, prev_focus, active_changed || monotonic_ns() >= loose_ns)) {
+			ok = 1;
+			break;
+		}
+		int64_t now_ns = monotonic_ns();
+		if (now_ns >= deadline_ns) break;
+		int wait_ms = (int)((deadline_ns - now_ns) / 1000000LL);
+		if (wait_ms > TYPE_FOCUS_POLL_MS) wait_ms = TYPE_FOCUS_POLL_MS;
+		struct pollfd pfd = {.fd = xfd, .events = POLLIN, .revents = 0};
+		if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) break;
+
+		xcb_generic_event_t *ev;
+		while ((ev = xcb_poll_for_event(app->conn))) {
+			uint8_t rt = ev->response_type & ~0x80;
+			if (rt == XCB_MAPPING_NOTIFY) {
+				xcb_refresh_keyboard_mapping(app->keysyms, (xcb_mapping_notify_event_t *)ev);
+				keyidx_invalidate(&app->keyidx);
+			} else if (rt == XCB_PROPERTY_NOTIFY) {
+				xcb_property_notify_event_t *e = (xcb_property_notify_event_t *)ev;
+				if (e->atom == net_active) {
+					DBG("[type] _NET_ACTIVE_WINDOW changed\n");
+					active_changed = 1;
+				}
+			}
+			free(ev);
+		}
+		if (xcb_connection_has_error(app->conn)) break;
+	}
+
+	if (net_active != XCB_NONE) {
+		uint32_t mask = XCB_EVENT_MASK_NO_EVENT;
+		xcb_change_window_attributes(app->conn, app->screen->root, XCB_CW_EVENT_MASK, &mask);
+	}
+	DBG("[type] Focus %s after %.1fms\n", ok ? "returned" : "wait timed out",
+	    (double)(monotonic_ns() - t0) / 1e6);
+}
+
+// --- Clipboard paste ------------------------------------------------------
+typedef struct
+{
+	xcb_window_t requestor;
+	xcb_atom_t property;
+	xcb_atom_t type;
+	const char *data;          // UTF-8 or Latin-1 copy, see PasteState
+	size_t len;
+	size_t offset;
+	int active;
+} PasteIncr;
+
+typedef struct
+{
+	xcb_window_t owner;
+	xcb_atom_t CLIPBOARD;
+	xcb_atom_t TARGETS;
+	xcb_atom_t INCR;
+	xcb_atom_t TEXT;
+	xcb_atom_t TEXT_PLAIN_UTF8;
+	xcb_atom_t UTF8_STRING;
+	const char *data;
+	size_t len;
+	char *latin1;              // data as ISO-8859-1 for STRING, NULL if not representable
+	size_t latin1_len;
+	size_t chunk;              // largest property write per request
+	PasteIncr incr[PASTE_MAX_INCR];
+	int served;                // a data target has been delivered completely
+} PasteState;
+
+// Parse a chord like "ctrl+shift+v" or "shift+Insert" into modifier
+// keysyms and the final key. Returns the number of modifiers, -1 on error.
+static int parse_paste_chord(const char *chord, xcb_keysym_t *mods, int max_mods, xcb_keysym_t *key)
+{
+	static const struct
+	{
+		const char *name;
+		xcb_keysym_t sym;
+		int is_mod;
+	} names[] = {
+		{"ctrl", XK_Control_L, 1},
+		{"control", XK_Control_L, 1},
+		{"shift", XK_Shift_L, 1},
+		{"alt", XK_Alt_L, 1},
+		{"super", XK_Super_L, 1},
+		{"insert", XK_Insert, 0},
+		{"return", XK_Return, 0},
+		{"tab", XK_Tab, 0},
+		{"space", XK_space, 0},
+	};
+	char buf[128];
+	snprintf(buf, sizeof(buf), "%s", chord);
+	int nmods = 0;
+	*key = XCB_NO_SYMBOL;
+	char *save = NULL;
+	for (char *tok = strtok_r(buf, "+", &save); tok; tok = strtok_r(NULL, "+", &save)) {
+		if (*key != XCB_NO_SYMBOL) return -1;  // the key must come last
+		xcb_keysym_t sym = XCB_NO_SYMBOL;
+		int is_mod = 0;
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+			if (!strcasecmp(tok, names[i].name)) {
+				sym = names[i].sym;
+				is_mod = names[i].is_mod;
+				break;
+			}
+		}
+		if (sym == XCB_NO_SYMBOL && strlen(tok) == 1 && tok[0] > 0x20 && tok[0] < 0x7F)
+			sym = (xcb_keysym_t)tolower((unsigned char)tok[0]);
+		if (sym == XCB_NO_SYMBOL) return -1;
+		if (is_mod) {
+			if (nmods >= max_mods) return -1;
+			mods[nmods++] = sym;
+		} else {
+			*key = sym;
+		}
+	}
+	return (*key != XCB_NO_SYMBOL) ? nmods : -1;
+}
+
+static const KeyIndexSlot *paste_key_lookup(App *app, xcb_keysym_t sym, int group)
+{
+	const KeyIndexSlot *s = keycode_for_keysym(app, sym, group);
+	if (!s && group != 0) s = keycode_for_keysym(app, sym, 0);
+	return s;
+}
+
+static int send_paste_chord(App *app, const char *chord)
+{
+	xcb_keysym_t mods[4], key;
+	int nmods = parse_paste_chord(chord, mods, 4, &key);
+	if (nmods < 0) {
+		DBG("[paste] Invalid chord \"%s\"\n", chord);
+		return 0;
+	}
+
+	refresh_active_group(app);
+	int group = (int)app->active_group;
+	xcb_keycode_t mod_kc[4];
+	for (int i = 0; i < nmods; ++i) {
+		const KeyIndexSlot *s = paste_key_lookup(app, mods[i], 0);
+		if (!s) {
+			DBG("[paste] No keycode for modifier 0x%08x\n", (unsigned)mods[i]);
+			return 0;
+		}
+		mod_kc[i] = s->kc;
+	}
+	// The chord names the unshifted key; any shift is part of the modifiers.
+	const KeyIndexSlot *ks = paste_key_lookup(app, key, group);
+	if (!ks) {
+		DBG("[paste] No keycode for key 0x%08x\n", (unsigned)key);
+		return 0;
+	}
+
+	DBG("[paste] Sending chord \"%s\"\n", chord);
+	for (int i = 0; i < nmods; ++i)
+		fake_key(app, 1, mod_kc[i]);
+	fake_key(app, 1, ks->kc);
+	fake_key(app, 0, ks->kc);
+	for (int i = nmods - 1; i >= 0; --i)
+		fake_key(app, 0, mod_kc[i]);
+	return 1;
+}
+
+static void paste_send_notify(App *app, const xcb_selection_request_event_t *req, xcb_atom_t property)
+{
+	xcb_selection_notify_event_t n;
+	memset(&n, 0, sizeof(n));
+	n.response_type = XCB_SELECTION_NOTIFY;
+	n.time = req->time;
+	n.requestor = req->requestor;
+	n.selection = req->selection;
+	n.target = req->target;
+	n.property = property;
+	xcb_send_event(app->conn, 0, req->requestor, XCB_EVENT_MASK_NO_EVENT, (const char *)&n);
+}
+
+// ICCCM STRING is ISO-8859-1. Returns NULL if s has characters outside it.
+static char *utf8_to_latin1(const char *s, size_t *len)
+{
+	char *out = (char *)malloc(strlen(s) + 1);
+	if (!out) return NULL;
+	const unsigned char *p = (const unsigned char *)s;
+	size_t n = 0;
+	while (*p) {
+		uint32_t cp;
+		p += utf8_decode(p, &cp);
+		if (cp > 0xFF) {
+			free(out);
+			return NULL;
+		}
+		out[n++] = (char)cp;
+	}
+	out[n] = '\0';
+	*len = n;
+	return out;
+}
+
+static void paste_handle_request(App *app, PasteState *ps, const xcb_selection_request_event_t *req)
+{
+	// Obsolete clients pass None; ICCCM says to use the target as property.
+	xcb_atom_t prop = (req->property != XCB_NONE) ? req->property : req->target;
+	xcb_atom_t reply_prop = XCB_NONE;
+
+	if (req->owner != ps->owner || (req->selection != ps->CLIPBOARD && req->selection != XCB_ATOM_PRIMARY)) {
+		DBG("[paste] Request for foreign selection ignored\n");
+	} else if (req->target == ps->TARGETS) {
+		// STRING only when the text fits in Latin-1
+		xcb_atom_t targets[] = {ps->TARGETS, ps->UTF8_STRING, ps->TEXT_PLAIN_UTF8, ps->TEXT, XCB_ATOM_STRING};
+		uint32_t n = sizeof(targets) / sizeof(targets[0]) - (ps->latin1 ? 0 : 1);
+		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, req->requestor, prop,
+		                    XCB_ATOM_ATOM, 32, n, targets);
+		reply_prop = prop;
+	} else if (req->target == XCB_ATOM_STRING && !ps->latin1) {
+		DBG("[paste] Text not representable as STRING; refused\n");
+	} else if (req->target == ps->UTF8_STRING || req->target == ps->TEXT_PLAIN_UTF8
+	           || req->target == ps->TEXT || req->target == XCB_ATOM_STRING) {
+		// TEXT lets the owner choose; we answer it with UTF-8.
+		xcb_atom_t type = (req->target == ps->TEXT) ? ps->UTF8_STRING : req->target;
+		const char *data = (req->target == XCB_ATOM_STRING) ? ps->latin1 : ps->data;
+		size_t len = (req->target == XCB_ATOM_STRING) ? ps->latin1_len : ps->len;
+		if (len > ps->chunk) {
+			PasteIncr *slot = NULL;
+			for (int i = 0; i < PASTE_MAX_INCR && !slot; ++i) {
+				if (!ps->incr[i].active) slot = &ps->incr[i];
+			}
+			if (slot) {
+				uint32_t total = (uint32_t)len;
+				uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+				xcb_change_window_attributes(app->conn, req->requestor, XCB_CW_EVENT_MASK, &mask);
+				xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, req->requestor, prop,
+				                    ps->INCR, 32, 1, &total);
+				slot->requestor = req->requestor;
+				slot->property = prop;
+				slot->type = type;
+				slot->data = data;
+				slot->len = len;
+				slot->offset = 0;
+				slot->active = 1;
+				reply_prop = prop;
+				DBG("[paste] Starting INCR transfer of %zu bytes to 0x%08x\n", len, (unsigned)req->requestor);
+			} else {
+				DBG("[paste] Too many concurrent INCR transfers; refusing\n");
+			}
+		} else {
+			xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, req->requestor, prop,
+			                    type, 8, (uint32_t)len, data);
+			reply_prop = prop;
+			ps->served = 1;
+			DBG("[paste] Served %zu bytes to 0x%08x\n", len, (unsigned)req->requestor);
+		}
+	} else {
+		DBG("[paste] Unsupported target %u refused\n", (unsigned)req->target);
+	}
+	paste_send_notify(app, req, reply_prop);
+	xcb_flush(app->conn);
+}
+
+static void paste_handle_property(App *app, PasteState *ps, const xcb_property_notify_event_t *e)
+{
+	if (e->state != XCB_PROPERTY_DELETE) return;
+	for (int i = 0; i < PASTE_MAX_INCR; ++i) {
+		PasteIncr *t = &ps->incr[i];
+		if (!t->active || t->requestor != e->window || t->property != e->atom) continue;
+
+		// The requestor consumed the previous chunk; append the next one.
+		// A zero-length write marks the end of the transfer.
+		size_t n = t->len - t->offset;
+		if (n > ps->chunk) n = ps->chunk;
+		xcb_change_property(app->conn, XCB_PROP_MODE_REPLACE, t->requestor, t->property,
+		                    t->type, 8, (uint32_t)n, t->data + t->offset);
+		t->offset += n;
+		if (n == 0) {
+			uint32_t mask = XCB_EVENT_MASK_NO_EVENT;
+			xcb_change_window_attributes(app->conn, t->requestor, XCB_CW_EVENT_MASK, &mask);
+			t->active = 0;
+			ps->served = 1;
+			DBG("[paste] INCR transfer to 0x%08x complete\n", (unsigned)t->requestor);
+		}
+		xcb_flush(app->conn);
+		return;
+	}
+}
+
+// Own CLIPBOARD and PRIMARY with text, inject the paste chord and serve
+// the resulting SelectionRequest(s) until the data went out or the
+// deadline passes. Returns 1 if the paste was served.
+static int paste_utf8_string(App *app, const char *s, const char *chord, xcb_timestamp_t time)
+{
+	if (!s) return 0;
+
+	PasteState ps;
+	memset(&ps, 0, sizeof(ps));
+	xcb_intern_atom_cookie_t ck[5];
+	const char *names[5] = {"CLIPBOARD", "TARGETS", "INCR", "TEXT", "text/plain;charset=utf-8"};
+	for (int i = 0; i < 5; ++i)
+		ck[i] = xcb_intern_atom(app->conn, 0, strlen(names[i]), names[i]);
+	xcb_atom_t *dst[5] = {&ps.CLIPBOARD, &ps.TARGETS, &ps.INCR, &ps.TEXT, &ps.TEXT_PLAIN_UTF8};
+	for (int i = 0; i < 5; ++i) {
+		xcb_intern_atom_reply_t *r = xstats_reply(xcb_intern_atom_reply(app->conn, ck[i], NULL));
+		*dst[i] = r ? r->atom : XCB_NONE;
+		free(r);
+	}
+	ps.UTF8_STRING = (app->UTF8_STRING != XCB_NONE) ? app->UTF8_STRING : intern_atom(app->conn, "UTF8_STRING", 0);
+	ps.data = s;
+	ps.len = strlen(s);
+	ps.latin1 = utf8_to_latin1(s, &ps.latin1_len);
+	// Property writes must fit in one request (header + padding aside).
+	size_t max_req = (size_t)xcb_get_maximum_request_length(app->conn) * 4;
+	ps.chunk = (max_req > 1024) ? max_req - 1024 : 1024;
+	if (ps.chunk > PASTE_MAX_CHUNK) ps.chunk = PASTE_MAX_CHUNK;
+
+	ps.owner = xcb_generate_id(app->conn);
+	xcb_create_window(app->conn, XCB_COPY_FROM_PARENT, ps.owner, app->screen->root,
+	                  -1, -1, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, NULL);
+	xcb_set_selection_owner(app->conn, ps.owner, ps.CLIPBOARD, time);
+	xcb_set_selection_owner(app->conn, ps.owner, XCB_ATOM_PRIMARY, time);
+	xcb_get_selection_owner_reply_t *own =
+	    xstats_reply(xcb_get_selection_owner_reply(app->conn, xcb_get_selection_owner(app->conn, ps.CLIPBOARD), NULL));
+	int owned = own && own->owner == ps.owner;
+	free(own);
+	if (!owned) {
+		DBG("[paste] Could not take CLIPBOARD ownership\n");
+		xcb_destroy_window(app->conn, ps.owner);
+		xcb_flush(app->conn);
+		free(ps.latin1);
+		return 0;
+	}
+	DBG("[paste] Owning CLIPBOARD/PRIMARY with %zu bytes (chunk %zu)\n", ps.len, ps.chunk);
+
+	if (!send_paste_chord(app, chord)) {
+		xcb_destroy_window(app->conn, ps.owner);
+		xcb_flush(app->conn);
+		free(ps.latin1);
+		return 0;
+	}
+
+	int xfd = xcb_get_file_descriptor(app->conn);
+	int64_t deadline_ns = monotonic_ns() + (int64_t)PASTE_TIMEOUT_MS * 1000000LL;
+	int lost = 0;
+	while (!ps.served && !lost) {
+		xcb_generic_event_t *ev = xcb_poll_for_event(app->conn);
+		if (!ev) {
+			int64_t now_ns = monotonic_ns();
+			if (now_ns >= deadline_ns) {
+				DBG("[paste] Deadline passed without a completed paste\n");
+				break;
+			}
+			if (xcb_connection_has_error(app->conn)) break;
+			struct pollfd pfd = {.fd = xfd, .events = POLLIN, .revents = 0};
+			int wait_ms = (int)((deadline_ns - now_ns + 999999LL) / 1000000LL);
+			if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) break;
+			continue;
+		}
+		switch (ev->response_type & ~0x80) {
+			case XCB_SELECTION_REQUEST:
+				paste_handle_request(app, &ps, (xcb_selection_request_event_t *)ev);
+				break;
+			case XCB_PROPERTY_NOTIFY:
+				paste_handle_property(app, &ps, (xcb_property_notify_event_t *)ev);
+				break;
+			case XCB_SELECTION_CLEAR:
+				{
+					xcb_selection_clear_event_t *e = (xcb_selection_clear_event_t *)ev;
+					if (e->selection == ps.CLIPBOARD) {
+						DBG("[paste] Lost CLIPBOARD ownership\n");
+						lost = 1;
+					}
+				}
+				break;
+			case XCB_MAPPING_NOTIFY:
+				xcb_refresh_keyboard_mapping(app->keysyms, (xcb_mapping_notify_event_t *)ev);
+				keyidx_invalidate(&app->keyidx);
+				break;
+			default: break;
+		}
+		free(ev);
+	}
+
+	xcb_destroy_window(app->conn, ps.owner);
+	xcb_flush(app->conn);
+	free(ps.latin1);
+	return ps.served;
+}
+
+// --- Typing benchmark (developer) ----------------------------------------
+// Driven by `dev.sh bench-type` under Xvfb: a receiver instance grabs the
+// keyboard and decodes what arrives, a driver instance types the same
+// corpus with type_utf8_string(). Both print one JSON line to stdout.
+#define BENCH_RECEIVER_IDLE_MS 1500   // receiver exits after this much silence
+#define BENCH_RECEIVER_MAX_MS  120000
+
+static const struct
+{
+	const char *name;
+	const char *text;
+} bench_corpora[] = {
+	{"ascii", "The quick brown fox jumps over the lazy dog. 0123456789\n"
+	          "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~ THE QUICK BROWN FOX\n"},
+	{"latin1", "Grüße aus Köln: Äpfel, Öl, Übermaß. "
+	           "Français: déjà vu, garçon, naïve, été. "
+	           "Español: año, niño, ¿qué? ¡sí! § ° µ ½\n"},
+	{"cjk", "漢字かなカナ 中文输入测试。"
+	        "日本語のテキスト、한국어 텍스트\n"},
+	{"emoji", "😀😃😄😁😆😅🤣😂"
+	          "🙂🙃😉😊 👍👋🎉🚀"
+	          "🔥✨💡✅❌\n"},
+	{"cyrillic", "Съешь же ещё этих "
+	             "мягких французских "
+	             "булок, да выпей чаю.\n"},
+};
+
+static const char *bench_corpus(const char *name)
+{
+	for (size_t i = 0; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); ++i) {
+		if (!strcmp(bench_corpora[i].name, name)) return bench_corpora[i].text;
+	}
+	return NULL;
+}
+
+static size_t utf8_count(const char *s)
+{
+	size_t n = 0;
+	for (const unsigned char *p = (const unsigned char *)s; *p; ++n) {
+		uint32_t cp;
+		p += utf8_decode(p, &cp);
+	}
+	return n;
+}
+
+static int bench_connect(App *app)
+{
+	int scrno = 0;
+	app->conn = xcb_connect(NULL, &scrno);
+	if (xcb_connection_has_error(app->conn)) {
+		fprintf(stderr, "Failed to connect to X server.\n");
+		return 0;
+	}
+	const xcb_setup_t *setup = xcb_get_setup(app->conn);
+	xcb_screen_iterator_t it = xcb_setup_roots_iterator(setup);
+	for (int s = 0; s < scrno; ++s)
+		xcb_screen_next(&it);
+	app->screen = it.data;
+	app->width = app->screen->width_in_pixels;
+	app->height = app->screen->height_in_pixels;
+	app->min_keycode = setup->min_keycode;
+	app->max_keycode = setup->max_keycode;
+	app->keysyms = xcb_key_symbols_alloc(app->conn);
+	init_xkb(app);
+	return 1;
+}
+
+static void bench_disconnect(App *app)
+{
+	keyidx_free(&app->keyidx);
+	xkbmap_free(&app->xkbmap);
+	if (app->keysyms) xcb_key_symbols_free(app->keysyms);
+	xcb_disconnect(app->conn);
+}
+
+static int run_type_bench(const char *corpus, int type_hex)
+{
+	const char *text = bench_corpus(corpus);
+	if (!text) {
+		fprintf(stderr, "Unknown corpus: %s\n", corpus);
+		return 2;
 	}
+	App app = (App){0};
+	if (!bench_connect(&app)) return 1;
+	app.type_remap = !type_hex;
+
+	int64_t t0 = monotonic_ns();
+	type_utf8_string(&app, text);
+	// Round trip: the server has processed every fake event.
+	free(xcb_get_input_focus_reply(app.conn, xcb_get_input_focus(app.conn), NULL));
+	double secs = (double)(monotonic_ns() - t0) / 1e9;
+
+	size_t chars = utf8_count(text);
+	printf("{\"bench\":\"type\",\"corpus\":\"%s\",\"chars\":%zu,\"fake_events\":%llu,"
+	       "\"seconds\":%.6f,\"chars_per_sec\":%.1f,\"events_per_char\":%.2f}\n",
+	       corpus, chars, (unsigned long long)app.fake_events, secs,
+	       secs > 0 ? (double)chars / secs : 0.0,
+	       chars ? (double)app.fake_events / (double)chars : 0.0);
+	fflush(stdout);
+	bench_disconnect(&app);
+	return 0;
 }
 
-static void usage(const char *argv0)
+// Core keymap column for a group/level pair (XKB's core mapping order:
+// G1L1 G1L2 G2L1 G2L2 G1L3 G1L4 G2L3 G2L4).
+static int core_column(int group, int level)
 {
-	fprintf(stderr, "gzg – XCB+Cairo fullscreen chooser\n");
-	fprintf(stderr, "Usage: echo -e \"A\\nB\\nC\" | %s [options]\n", argv0);
-	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "  -h, --help            Show this help and exit\n");
-	fprintf(stderr, "  -kmp, --keep-mouse-pos\n");
-	fprintf(stderr, "                        Do not move the mouse pointer to screen center\n");
-	fprintf(stderr, "                        and do not restore it after exit.\n");
-	fprintf(stderr, "  -s, --screenshot      Use a dimmed screenshot as background and mark\n");
-	fprintf(stderr, "                        the original cursor position with a red circle.\n");
-	fprintf(stderr, "  -m, --multiple        Allow multiple instances (disables single-instance\n");
-	fprintf(stderr, "                        lock; by default only one instance per user and\n");
-	fprintf(stderr, "                        $DISPLAY can run).\n");
-	fprintf(stderr, "  -nkb, --no-keyboard   Disable all keyboard handling (Esc, arrows, hjkl,\n");
-	fprintf(stderr, "                        Enter). Mouse-only mode.\n");
-	fprintf(stderr, "  -t, --type            Instead of printing selection to stdout, type it via\n");
-	fprintf(stderr, "                        XTEST virtual keypresses after closing. A small\n");
-	fprintf(stderr, "                        delay (%dms) is applied before typing.\n", TYPE_DELAY_MS);
-	fprintf(stderr, "      --timeout SEC     Exit after SEC seconds without selection\n");
-	fprintf(stderr, "                        (default: 10). Applies to all modes.\n");
+	if (group > 1) group = 0;
+	if (level < 2) return group * 2 + level;
+	return 4 + group * 2 + (level - 2);
 }
 
-static void grab_input(App *app, int grab_keyboard)
+// Decode like a client would: the XKB model when available, the core
+// columns otherwise.
+static xcb_keysym_t bench_decode_key(App *app, xcb_keycode_t kc, uint16_t state)
 {
-	// Grab pointer to avoid click-through to underlying apps.
-	xcb_grab_pointer_cookie_t pc =
-	    xcb_grab_pointer(app->conn,
-	                     0,                 // owner_events
-	                     app->win,          // grab on our window
-	                     XCB_EVENT_MASK_BUTTON_PRESS |
-	                         XCB_EVENT_MASK_BUTTON_RELEASE |
-	                         XCB_EVENT_MASK_POINTER_MOTION,
-	                     XCB_GRAB_MODE_ASYNC,
-	                     XCB_GRAB_MODE_ASYNC,
-	                     app->win,          // confine_to
-	                     XCB_NONE,          // cursor
-	                     XCB_CURRENT_TIME);
-	xcb_grab_pointer_reply_t *pr = xcb_grab_pointer_reply(app->conn, pc, NULL);
-	if (pr) {
-		DBG("[piewin] Grab pointer status=%u\n", pr->status);
-		free(pr);
-	} else {
-		DBG("[piewin] Grab pointer: no reply\n");
+	int group = (state >> 13) & 3;
+	if (app->xkbmap.valid) return xkbmap_keysym(&app->xkbmap, kc, group, (uint8_t)(state & 0xFF));
+	int level = ((state & XCB_MOD_MASK_SHIFT) ? 1 : 0) + ((state & XCB_MOD_MASK_5) ? 2 : 0);
+	xcb_keysym_t sym = xcb_key_symbols_get_keysym(app->keysyms, kc, core_column(group, level));
+	if (sym == XCB_NO_SYMBOL && level) sym = xcb_key_symbols_get_keysym(app->keysyms, kc, core_column(group, 0));
+	return sym;
+}
+
+static int run_type_receiver(const char *corpus)
+{
+	const char *text = bench_corpus(corpus);
+	if (!text) {
+		fprintf(stderr, "Unknown corpus: %s\n", corpus);
+		return 2;
+	}
+	App app = (App){0};
+	if (!bench_connect(&app)) return 1;
+	xkbmap_fetch(&app);
+
+	uint32_t vals[2] = {app.screen->black_pixel, XCB_EVENT_MASK_KEY_PRESS};
+	app.win = xcb_generate_id(app.conn);
+	xcb_create_window(app.conn, XCB_COPY_FROM_PARENT, app.win, app.screen->root, 0, 0, 200, 100, 0,
+	                  XCB_WINDOW_CLASS_INPUT_OUTPUT, app.screen->root_visual,
+	                  XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, vals);
+	xcb_map_window(app.conn, app.win);
+	xcb_set_input_focus(app.conn, XCB_INPUT_FOCUS_POINTER_ROOT, app.win, XCB_CURRENT_TIME);
+	xcb_grab_keyboard_reply_t *kr = xcb_grab_keyboard_reply(
+	    app.conn,
+	    xcb_grab_keyboard(app.conn, 0, app.win, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC),
+	    NULL);
+	int grabbed = kr && kr->status == XCB_GRAB_STATUS_SUCCESS;
+	free(kr);
+	if (!grabbed) {
+		fprintf(stderr, "Receiver could not grab the keyboard\n");
+		bench_disconnect(&app);
+		return 1;
+	}
+	printf("# ready\n");
+	fflush(stdout);
+
+	size_t cap = 256, n = 0;
+	uint32_t *got = (uint32_t *)malloc(cap * sizeof(uint32_t));
+	uint64_t keypresses = 0;
+	int xfd = xcb_get_file_descriptor(app.conn);
+	int64_t start_ns = monotonic_ns();
+	int64_t last_ns = start_ns;
+	while (got) {
+		xcb_generic_event_t *ev = xcb_poll_for_event(app.conn);
+		if (!ev) {
+			int64_t now_ns = monotonic_ns();
+			int idle_ms = keypresses ? BENCH_RECEIVER_IDLE_MS : BENCH_RECEIVER_MAX_MS;
+			if (now_ns - last_ns >= (int64_t)idle_ms * 1000000LL) break;
+			if (now_ns - start_ns >= (int64_t)BENCH_RECEIVER_MAX_MS * 1000000LL) break;
+			if (xcb_connection_has_error(app.conn)) break;
+			struct pollfd pfd = {.fd = xfd, .events = POLLIN, .revents = 0};
+			poll(&pfd, 1, 50);
+			continue;
+		}
+		uint8_t rt = ev->response_type & ~0x80;
+		if (rt == XCB_MAPPING_NOTIFY) {
+			xcb_refresh_keyboard_mapping(app.keysyms, (xcb_mapping_notify_event_t *)ev);
+			xkbmap_fetch(&app);
+		} else if (rt == XCB_KEY_PRESS) {
+			xcb_key_press_event_t *e = (xcb_key_press_event_t *)ev;
+			keypresses++;
+			last_ns = monotonic_ns();
+			xcb_keysym_t sym = bench_decode_key(&app, e->detail, e->state);
+			uint32_t cp = (e->state & XCB_MOD_MASK_CONTROL) ? 0 : keysym_to_codepoint(sym);
+			DBG("[bench] key kc=%u state=0x%04x sym=0x%08x cp=U+%04X\n",
+			    (unsigned)e->detail, (unsigned)e->state, (unsigned)sym, cp);
+			if (cp) {
+				if (n == cap) {
+					uint32_t *tmp = (uint32_t *)realloc(got, (cap *= 2) * sizeof(uint32_t));
+					if (!tmp) break;
+					got = tmp;
+				}
+				got[n++] = cp;
+			}
+		}
+		free(ev);
 	}
 
-	// Optionally grab keyboard so Esc/hjkl/arrows don't leak.
-	if (grab_keyboard) {
-		xcb_grab_keyboard_cookie_t kc =
-		    xcb_grab_keyboard(app->conn,
-		                      0,
-		                      app->win,
-		                      XCB_CURRENT_TIME,
-		                      XCB_GRAB_MODE_ASYNC,
-		                      XCB_GRAB_MODE_ASYNC);
-		xcb_grab_keyboard_reply_t *kr = xcb_grab_keyboard_reply(app->conn, kc, NULL);
-		if (kr) {
-			DBG("[piewin] Grab keyboard status=%u\n", kr->status);
-			free(kr);
-		} else {
-			DBG("[piewin] Grab keyboard: no reply\n");
+	// Position-wise comparison; surplus or missing characters count too.
+	size_t expected = 0, mismatches = 0;
+	for (const unsigned char *p = (const unsigned char *)text; *p; ++expected) {
+		uint32_t cp;
+		p += utf8_decode(p, &cp);
+		if (expected >= n || !got || got[expected] != cp) mismatches++;
+	}
+	if (n > expected) mismatches += n - expected;
+	printf("{\"bench\":\"type-receive\",\"corpus\":\"%s\",\"expected\":%zu,\"received\":%zu,"
+	       "\"keypresses\":%llu,\"mismatches\":%zu}\n",
+	       corpus, expected, n, (unsigned long long)keypresses, mismatches);
+	fflush(stdout);
+	free(got);
+	bench_disconnect(&app);
+	return 0;
+}
+
+// --- Entry input ----------------------------------------------------------
+// One entry per line; empty lines are skipped. "text<TAB>icon.png" attaches
+// an icon. Returns 0 on allocation failure (after reporting it).
+static int read_entries(FILE *f, Entry **out, size_t *out_count)
+{
+	Entry *entries = NULL;
+	size_t cap = 0, count = 0;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t r;
+	while ((r = getline(&line, &len, f)) != -1) {
+		// Trim newline(s)
+		while (r > 0 && (line[r - 1] == '\n' || line[r - 1] == '\r')) {
+			line[--r] = '\0';
 		}
-	} else {
-		DBG("[piewin] Keyboard grab skipped (no-keyboard mode)\n");
+		if (r == 0) continue;  // skip empty lines
+		if (count == cap) {
+			cap = cap ? cap * 2 : 8;
+			Entry *tmp = (Entry *)realloc(entries, cap * sizeof(Entry));
+			if (!tmp) {
+				perror("realloc");
+				free(line);
+				return 0;
+			}
+			entries = tmp;
+		}
+		char *tab = memchr(line, '\t', (size_t)r);
+		entries[count].text = strndup(line, tab ? (size_t)(tab - line) : (size_t)r);
+		entries[count].icon_path = (tab && tab[1]) ? strdup(tab + 1) : NULL;
+		entries[count].icon = NULL;
+		if (!entries[count].text || (tab && tab[1] && !entries[count].icon_path)) {
+			perror("strndup");
+			free(line);
+			return 0;
+		}
+		DBG("[piewin] Read entry[%zu]: \"%s\"\n", count, entries[count].text);
+		count++;
 	}
-	xcb_flush(app->conn);
+	free(line);
+	*out = entries;
+	*out_count = count;
+	return 1;
 }
 
-static void ungrab_input(App *app)
+static void free_entries(Entry *entries, size_t count)
 {
-	xcb_ungrab_pointer(app->conn, XCB_CURRENT_TIME);
-	xcb_ungrab_keyboard(app->conn, XCB_CURRENT_TIME);
-	xcb_flush(app->conn);
-	DBG("[piewin] Ungrab input\n");
+	for (size_t i = 0; i < count; ++i) {
+		free(entries[i].text);
+		free(entries[i].icon_path);
+		if (entries[i].icon) cairo_surface_destroy(entries[i].icon);
+	}
+	free(entries);
 }
 
-// --- Screenshot helper ---------------------------------------------------
-// Must match cairo_destroy_func_t (void (*)(void*))
-static void free_user_data(void *data)
+// "Entry 1" .. "Entry n", for headless rendering and benchmarks.
+static Entry *synthetic_entries(int n)
 {
-	DBG("[piewin] Freeing screenshot buffer\n");
-	free(data);
+	Entry *e = (Entry *)calloc((size_t)n, sizeof(Entry));
+	for (int i = 0; e && i < n; ++i) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "Entry %d", i + 1);
+		e[i].text = strdup(buf);
+	}
+	return e;
 }
 
-static cairo_surface_t *capture_dimmed_screenshot_with_cursor(App *app, int mouse_x, int mouse_y, int have_pos)
+// --- Icon cache -----------------------------------------------------------
+// Icons are decoded and scaled once, then kept as premultiplied ARGB32 in
+// $XDG_CACHE_HOME/gzg (default ~/.cache/gzg), one file per source path,
+// mtime, size and thumbnail size. A cache hit is an mmap: the image surface
+// points straight into the mapping, so startup does no decoding.
+#define ICON_CACHE_MAGIC   "GZGI"
+#define ICON_CACHE_VERSION 1
+#define ICON_MIN_PX        16
+#define ICON_MAX_PX        256
+
+typedef struct
 {
-	int W = app->width, H = app->height;
-	DBG("[piewin] Capturing screenshot of %dx%d (root=0x%08x)\n", W, H, (unsigned)app->screen->root);
-	xcb_get_image_cookie_t ck =
-	    xcb_get_image(app->conn, XCB_IMAGE_FORMAT_Z_PIXMAP, app->screen->root,
-	                  0, 0, W, H, ~0u);
-	xcb_get_image_reply_t *rep = xcb_get_image_reply(app->conn, ck, NULL);
-	if (!rep) {
-		DBG("[piewin] xcb_get_image failed; no background will be used.\n");
+	char magic[4];
+	uint32_t version;
+	int64_t mtime_ns;          // of the source file
+	int64_t size;              // of the source file
+	uint32_t px;               // thumbnail box the icon was scaled into
+	uint32_t width, height, stride;
+	uint32_t path_len;         // source path follows the header
+	uint32_t data_off;         // pixels, 64-byte aligned
+} IconCacheHeader;
+
+typedef struct
+{
+	void *base;
+	size_t len;
+} IconMapping;
+
+static cairo_user_data_key_t icon_mapping_key;
+
+static void unmap_user_data(void *data)
+{
+	IconMapping *m = (IconMapping *)data;
+	munmap(m->base, m->len);
+	free(m);
+}
+
+static uint64_t fnv1a64(uint64_t h, const void *p, size_t n)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	for (size_t i = 0; i < n; ++i) {
+		h ^= s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Thumbnail size for the layout, rounded down to a few fixed sizes so the
+// cache is shared between similar screens.
+static int icon_size_for(int n, int rings, int W, int H)
+{
+	static const int sizes[] = {256, 192, 128, 96, 64, 48, 32, 24, 16};
+	double box;
+	if (rings > 1) {
+		box = 0.7 * ring_thickness(rings, W, H);
+	} else {
+		double rmid = 0.25 * fmin(W, H);
+		double chord = 0.9 * 2.0 * rmid * sin(fmin(M_PI / fmax(n, 1), M_PI * 0.5));
+		box = fmin(0.6 * rmid, 0.4 * chord);
+	}
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		if (box >= sizes[i]) return sizes[i];
+	return ICON_MIN_PX;
+}
+
+static int icon_cache_path(const char *src, const struct stat *st, int px, char *out, size_t outsz)
+{
+	char dir[PATH_MAX];
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && *xdg)
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	else if (home && *home)
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	else
+		return 0;
+	mkdir(dir, 0700);
+	size_t dl = strlen(dir);
+	if (dl + 5 >= sizeof(dir)) return 0;
+	memcpy(dir + dl, "/gzg", 5);
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) return 0;
+
+	int64_t mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	int64_t size = (int64_t)st->st_size;
+	uint64_t h = 1469598103934665603ULL;
+	h = fnv1a64(h, src, strlen(src) + 1);
+	h = fnv1a64(h, &mtime_ns, sizeof(mtime_ns));
+	h = fnv1a64(h, &size, sizeof(size));
+	h = fnv1a64(h, &px, sizeof(px));
+	int w = snprintf(out, outsz, "%s/%016llx.argb", dir, (unsigned long long)h);
+	return w > 0 && (size_t)w < outsz;
+}
+
+static cairo_surface_t *icon_cache_map(const char *file, const char *src, const struct stat *st, int px)
+{
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+	struct stat cst;
+	if (fstat(fd, &cst) != 0 || (size_t)cst.st_size < sizeof(IconCacheHeader)) {
+		close(fd);
 		return NULL;
 	}
-	uint8_t *src = xcb_get_image_data(rep);
-	uint32_t data_len = xcb_get_image_data_length(rep);
-	int pixels = W * H;
-	int bpp = (pixels > 0) ? (int)(data_len / pixels) : 0;
-	DBG("[piewin] Screenshot depth=%u bpp=%d data_len=%u\n", rep->depth, bpp, data_len);
-
-	// Convert to 32bpp RGB24 buffer for Cairo.
-	int stride = W * 4;
-	uint32_t *dst = (uint32_t *)malloc((size_t)stride * H);
-	if (!dst) {
-		DBG("[piewin] malloc failed for screenshot buffer\n");
-		free(rep);
+	size_t len = (size_t)cst.st_size;
+	void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return NULL;
+
+	const IconCacheHeader *hd = (const IconCacheHeader *)base;
+	size_t src_len = strlen(src);
+	int ok = !memcmp(hd->magic, ICON_CACHE_MAGIC, 4) && hd->version == ICON_CACHE_VERSION
+	         && hd->mtime_ns == (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec
+	         && hd->size == (int64_t)st->st_size && hd->px == (uint32_t)px
+	         && hd->path_len == src_len && sizeof(*hd) + src_len <= len
+	         && !memcmp((const char *)base + sizeof(*hd), src, src_len)
+	         && hd->stride == (uint32_t)cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, (int)hd->width)
+	         && (hd->data_off & 63) == 0 && hd->data_off <= len
+	         && (uint64_t)hd->stride * hd->height <= len - hd->data_off;
+	IconMapping *m = ok ? (IconMapping *)malloc(sizeof(*m)) : NULL;
+	if (!m) {
+		munmap(base, len);
 		return NULL;
 	}
-
-	if (bpp >= 4) {
-		// Fast path: copy as 32bpp
-		memcpy(dst, src, (size_t)stride * H);
-	} else if (bpp == 3) {
-		// Expand 24bpp to 32bpp (assume src order B,G,R)
-		for (int i = 0, si = 0; i < pixels; ++i, si += 3) {
-			uint8_t B = src[si + 0];
-			uint8_t G = src[si + 1];
-			uint8_t R = src[si + 2];
-			dst[i] = ((uint32_t)R << 16) | ((uint32_t)G << 8) | (uint32_t)B;
-		}
-	} else {
-		DBG("[piewin] Unsupported bpp=%d for screenshot; disabling.\n", bpp);
-		free(dst);
-		free(rep);
+	m->base = base;
+	m->len = len;
+	cairo_surface_t *s = cairo_image_surface_create_for_data((unsigned char *)base + hd->data_off,
+	                                                         CAIRO_FORMAT_ARGB32, (int)hd->width,
+	                                                         (int)hd->height, (int)hd->stride);
+	if (cairo_surface_status(s) != CAIRO_STATUS_SUCCESS
+	    || cairo_surface_set_user_data(s, &icon_mapping_key, m, unmap_user_data) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(s);
+		unmap_user_data(m);
 		return NULL;
 	}
-	free(rep);
+	return s;
+}
 
-	static cairo_user_data_key_t KEY_FREE;
-	cairo_surface_t *img = cairo_image_surface_create_for_data(
-	    (unsigned char *)dst, CAIRO_FORMAT_RGB24, W, H, stride);
-	if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-		DBG("[piewin] cairo_image_surface_create_for_data failed\n");
-		free(dst);
+// Decode a PNG and scale it to fit a px x px box.
+static cairo_surface_t *icon_build(const char *src, int px)
+{
+	cairo_surface_t *png = cairo_image_surface_create_from_png(src);
+	if (cairo_surface_status(png) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(png);
 		return NULL;
 	}
-	cairo_surface_set_user_data(img, &KEY_FREE, dst, free_user_data);
-	DBG("[piewin] Screenshot surface created and user data hook set\n");
-
-	// Dim and draw cursor mark directly onto the image once
-	cairo_t *tcr = cairo_create(img);
-	// Dim brightness with translucent black
-	cairo_set_source_rgba(tcr, 0.0, 0.0, 0.0, 0.40);
-	cairo_rectangle(tcr, 0, 0, W, H);
-	cairo_fill(tcr);
-
-	if (have_pos) {
-		double r = 16.0; // 32x32 diameter
-		double cx = (double)mouse_x;
-		double cy = (double)mouse_y;
-		DBG("[piewin] Drawing cursor marker at %d,%d\n", mouse_x, mouse_y);
-
-		// Soft halo
-		cairo_set_source_rgba(tcr, 0.0, 0.0, 0.0, 0.35);
-		cairo_arc(tcr, cx, cy, r + 3.0, 0, 2 * M_PI);
-		cairo_fill(tcr);
+	int sw = cairo_image_surface_get_width(png), sh = cairo_image_surface_get_height(png);
+	double scale = (double)px / (double)(sw > sh ? sw : sh);
+	int w = (int)fmax(1.0, round(sw * scale)), h = (int)fmax(1.0, round(sh * scale));
+	cairo_surface_t *out = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+	cairo_t *cr = cairo_create(out);
+	cairo_scale(cr, (double)w / sw, (double)h / sh);
+	cairo_set_source_surface(cr, png, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BEST);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	cairo_surface_destroy(png);
+	cairo_surface_flush(out);
+	return out;
+}
 
-		// Fill red
-		cairo_set_source_rgba(tcr, 1.0, 0.1, 0.1, 0.9);
-		cairo_arc(tcr, cx, cy, r, 0, 2 * M_PI);
-		cairo_fill(tcr);
+// Best effort: written to a temporary file and renamed into place, so a
+// concurrent reader never maps a partial file.
+static void icon_cache_store(const char *file, const char *src, const struct stat *st, int px, cairo_surface_t *img)
+{
+	IconCacheHeader hd = {0};
+	memcpy(hd.magic, ICON_CACHE_MAGIC, 4);
+	hd.version = ICON_CACHE_VERSION;
+	hd.mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	hd.size = (int64_t)st->st_size;
+	hd.px = (uint32_t)px;
+	hd.width = (uint32_t)cairo_image_surface_get_width(img);
+	hd.height = (uint32_t)cairo_image_surface_get_height(img);
+	hd.stride = (uint32_t)cairo_image_surface_get_stride(img);
+	hd.path_len = (uint32_t)strlen(src);
+	hd.data_off = (uint32_t)((sizeof(hd) + hd.path_len + 63) & ~(size_t)63);
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+	FILE *f = fopen(tmp, "wb");
+	if (!f) return;
+	static const char pad[64];
+	int ok = fwrite(&hd, sizeof(hd), 1, f) == 1 && fwrite(src, 1, hd.path_len, f) == hd.path_len
+	         && fwrite(pad, 1, hd.data_off - sizeof(hd) - hd.path_len, f) == hd.data_off - sizeof(hd) - hd.path_len
+	         && fwrite(cairo_image_surface_get_data(img), hd.stride, hd.height, f) == hd.height;
+	if (fclose(f) != 0) ok = 0;
+	if (!ok || rename(tmp, file) != 0) unlink(tmp);
+}
 
-		// Outline
-		cairo_set_source_rgba(tcr, 1.0, 1.0, 1.0, 0.9);
-		cairo_set_line_width(tcr, 2.0);
-		cairo_arc(tcr, cx, cy, r, 0, 2 * M_PI);
-		cairo_stroke(tcr);
+static cairo_surface_t *load_icon(const char *src, int px)
+{
+	struct stat st;
+	if (stat(src, &st) != 0) {
+		DBG("[icons] %s: %s\n", src, strerror(errno));
+		return NULL;
 	}
-	cairo_destroy(tcr);
+	char file[PATH_MAX];
+	int cacheable = icon_cache_path(src, &st, px, file, sizeof(file));
+	cairo_surface_t *s = cacheable ? icon_cache_map(file, src, &st, px) : NULL;
+	if (s) {
+		DBG("[icons] %s: mapped %s\n", src, file);
+		return s;
+	}
+	s = icon_build(src, px);
+	if (!s) {
+		DBG("[icons] %s: not a readable PNG\n", src);
+		return NULL;
+	}
+	if (cacheable) icon_cache_store(file, src, &st, px, s);
+	DBG("[icons] %s: decoded at %dpx%s\n", src, px, cacheable ? ", cached" : "");
+	return s;
+}
 
-	return img;
+static void load_icons(Entry *entries, size_t count, int px)
+{
+	for (size_t i = 0; i < count; ++i)
+		if (entries[i].icon_path && !entries[i].icon) entries[i].icon = load_icon(entries[i].icon_path, px);
 }
 
-// --- XTEST typing helpers -------------------------------------------------
-static void fake_key(App *app, uint8_t press, xcb_keycode_t kc)
+// --- Headless rendering (developer) --------------------------------------
+// Renders frames into a plain image surface without an X connection, to
+// write PNGs, compare against golden images or time render_scene().
+#define GOLDEN_TOLERANCE 8  // per channel, on top of the 3x3 neighbourhood range
+
+typedef struct
 {
-	DBG("[type] fake %s kc=%u\n", press ? "press" : "release", (unsigned)kc);
-	xcb_test_fake_input(app->conn, press ? XCB_KEY_PRESS : XCB_KEY_RELEASE,
-	                    kc, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-	xcb_flush(app->conn);
-	sleep_us(TYPE_EVENT_DELAY_US);
+	const char *png_out;       // --render-png
+	const char *golden;        // --render-compare
+	int frames;                // --render-bench
+	int width, height;         // --size
+	int hover_idx;             // --hover, -1 = last entry like the UI
+	const char *entries_file;  // --entries-file, else stdin
+	int synthetic;             // --synthetic N
+	int rings;                 // -r/--rings: use the ring layout
+	int compact;               // -c/--compact: clip the pie to a disc
+} RenderOpts;
+
+static int parse_size(const char *s, int *w, int *h)
+{
+	char *end = NULL;
+	long lw = strtol(s, &end, 10);
+	if (!end || (*end != 'x' && *end != 'X')) return 0;
+	long lh = strtol(end + 1, &end, 10);
+	if (!end || *end || lw <= 0 || lh <= 0 || lw > 16384 || lh > 16384) return 0;
+	*w = (int)lw;
+	*h = (int)lh;
+	return 1;
 }
 
-static void refresh_active_group(App *app)
+static int is_headless(const RenderOpts *ro)
 {
-	app->active_group = 0;
-	if (!app->xkb_available) return;
+	return ro->png_out || ro->golden || ro->frames > 0;
+}
 
-	xcb_xkb_get_state_cookie_t ck = xcb_xkb_get_state(app->conn, XCB_XKB_ID_USE_CORE_KBD);
-	xcb_xkb_get_state_reply_t *rep = xcb_xkb_get_state_reply(app->conn, ck, NULL);
-	if (!rep) {
-		DBG("[type] xkb_get_state failed; using group 0\n");
-		return;
+// Anti-aliasing tolerant comparison: each rendered pixel must lie within
+// the per-channel range of the golden pixels in its 3x3 neighbourhood
+// (plus a small tolerance), so edge coverage differences are accepted.
+static long compare_to_golden(cairo_surface_t *img, const char *path)
+{
+	cairo_surface_t *gold = cairo_image_surface_create_from_png(path);
+	if (cairo_surface_status(gold) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Cannot load golden image %s\n", path);
+		cairo_surface_destroy(gold);
+		return -1;
 	}
-
-	app->active_group = rep->group;
-	DBG("[type] Active keyboard group: %u\n", (unsigned)app->active_group);
-	free(rep);
+	int W = cairo_image_surface_get_width(img), H = cairo_image_surface_get_height(img);
+	if (cairo_image_surface_get_width(gold) != W || cairo_image_surface_get_height(gold) != H) {
+		fprintf(stderr, "Golden image %s is %dx%d, rendered %dx%d\n", path,
+		        cairo_image_surface_get_width(gold), cairo_image_surface_get_height(gold), W, H);
+		cairo_surface_destroy(gold);
+		return -1;
+	}
+	cairo_surface_flush(img);
+	const unsigned char *a = cairo_image_surface_get_data(img);
+	const unsigned char *g = cairo_image_surface_get_data(gold);
+	int sa = cairo_image_surface_get_stride(img), sg = cairo_image_surface_get_stride(gold);
+
+	long bad = 0;
+	for (int y = 0; y < H; ++y) {
+		const uint32_t *row = (const uint32_t *)(a + (size_t)y * sa);
+		for (int x = 0; x < W; ++x) {
+			int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+			for (int dy = -1; dy <= 1; ++dy) {
+				int yy = y + dy;
+				if (yy < 0 || yy >= H) continue;
+				const uint32_t *grow = (const uint32_t *)(g + (size_t)yy * sg);
+				for (int dx = -1; dx <= 1; ++dx) {
+					int xx = x + dx;
+					if (xx < 0 || xx >= W) continue;
+					for (int c = 0; c < 3; ++c) {
+						int v = (int)(grow[xx] >> (c * 8)) & 0xFF;
+						if (v < lo[c]) lo[c] = v;
+						if (v > hi[c]) hi[c] = v;
+					}
+				}
+			}
+			for (int c = 0; c < 3; ++c) {
+				int v = (int)(row[x] >> (c * 8)) & 0xFF;
+				if (v < lo[c] - GOLDEN_TOLERANCE || v > hi[c] + GOLDEN_TOLERANCE) {
+					if (bad < 5) DBG("[render] mismatch at %d,%d: 0x%06x\n", x, y, (unsigned)(row[x] & 0xFFFFFF));
+					bad++;
+					break;
+				}
+			}
+		}
+	}
+	cairo_surface_destroy(gold);
+	return bad;
 }
 
-static void init_xkb(App *app)
+static int run_render(const RenderOpts *ro)
 {
-	app->xkb_available = 0;
-	xcb_xkb_use_extension_cookie_t ck = xcb_xkb_use_extension(app->conn,
-	                                                          XCB_XKB_MAJOR_VERSION,
-	                                                          XCB_XKB_MINOR_VERSION);
-	xcb_xkb_use_extension_reply_t *rep = xcb_xkb_use_extension_reply(app->conn, ck, NULL);
-	if (!rep) {
-		DBG("[type] XKB use_extension reply failed; using group 0\n");
-		return;
+	Entry *entries = NULL;
+	size_t count = 0;
+	if (ro->synthetic > 0) {
+		entries = synthetic_entries(ro->synthetic);
+		if (!entries) return 1;
+		count = (size_t)ro->synthetic;
+	} else {
+		FILE *f = ro->entries_file ? fopen(ro->entries_file, "r") : stdin;
+		if (!f) {
+			fprintf(stderr, "Cannot open %s: %s\n", ro->entries_file, strerror(errno));
+			return 2;
+		}
+		int ok = read_entries(f, &entries, &count);
+		if (f != stdin) fclose(f);
+		if (!ok) return 1;
 	}
-	if (!rep->supported) {
-		DBG("[type] XKB extension not supported; using group 0\n");
-		free(rep);
-		return;
+
+	cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, ro->width, ro->height);
+	cairo_t *cr = cairo_create(surf);
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_FAST);
+	Scene sc = {
+		.width = ro->width,
+		.height = ro->height,
+		.entries = entries,
+		.n = (int)count,
+		.hover_idx = (ro->hover_idx >= 0) ? ro->hover_idx : (int)count - 1,
+		.rings = ro->rings ? ring_count_for((int)count) : 0,
+		.compact = ro->compact,
+	};
+	load_icons(entries, count, icon_size_for(sc.n, sc.rings, ro->width, ro->height));
+
+	int rc = 0;
+	if (ro->frames > 0) {
+		Histogram h = {0};
+		int64_t total_ns = 0;
+		for (int i = 0; i < ro->frames; ++i) {
+			int64_t t0 = monotonic_ns();
+			render_scene(cr, &sc);
+			cairo_surface_flush(surf);
+			int64_t dt = monotonic_ns() - t0;
+			total_ns += dt;
+			hist_record(&h, dt / 1000);
+		}
+		printf("{\"bench\":\"render\",\"n\":%zu,\"rings\":%d,\"width\":%d,\"height\":%d,\"frames\":%d,"
+		       "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}\n",
+		       count, sc.rings, ro->width, ro->height, ro->frames, (double)total_ns / 1e6 / ro->frames,
+		       (double)hist_percentile(&h, 50.0) / 1e3, (double)hist_percentile(&h, 99.0) / 1e3,
+		       (double)h.max_us / 1e3);
+		fflush(stdout);
+	} else {
+		render_scene(cr, &sc);
 	}
 
-	app->xkb_available = 1;
-	free(rep);
-	refresh_active_group(app);
+	if (ro->png_out && cairo_surface_write_to_png(surf, ro->png_out) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Cannot write %s\n", ro->png_out);
+		rc = 1;
+	}
+	if (ro->golden) {
+		long bad = compare_to_golden(surf, ro->golden);
+		printf("{\"check\":\"golden\",\"file\":\"%s\",\"mismatched_pixels\":%ld}\n", ro->golden, bad);
+		if (bad != 0) rc = 1;
+	}
+
+	cairo_destroy(cr);
+	cairo_surface_destroy(surf);
+	free_entries(entries, count);
+	return rc;
 }
 
-static void release_all_keys(App *app)
+// --- Record and replay (developer) ---------------------------------------
+// --record PATH logs the input the event loop processed, as text:
+//   gzg-record 1
+//   size W H
+//   rings R
+//   compact C
+//   entry TEXT               (one per entry, in order)
+//   T_US motion X Y          (T_US: microseconds since the loop started)
+//   T_US press|release BUTTON X Y
+//   T_US key KEYSYM          (hex; keysyms, so replays do not depend on the keymap)
+//   T_US configure W H
+//   # TEXT                   (comment, ignored; --record writes none)
+// --replay PATH renders such a log headless and prints one JSON line per
+// event plus a summary. Marking-mode strokes replay as plain motion.
+#define RECORD_VERSION 1
+
+static struct
 {
-	// Defensive: release every keycode in the server-advertised range in case
-	// an event was dropped and a key is stuck repeating.
-	if (!app->conn) return;
-	if (app->min_keycode > app->max_keycode) return;
+	FILE *f;
+	int64_t t0_ns;
+} g_record;
 
-	for (int kc = (int)app->min_keycode; kc <= (int)app->max_keycode; ++kc) {
-		xcb_test_fake_input(app->conn, XCB_KEY_RELEASE, kc,
-		                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+static int record_open(const char *path, int W, int H, int rings, int compact, const Entry *entries, size_t count)
+{
+	g_record.f = fopen(path, "w");
+	if (!g_record.f) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		return 0;
 	}
-	xcb_flush(app->conn);
+	fprintf(g_record.f, "gzg-record %d\nsize %d %d\nrings %d\ncompact %d\n", RECORD_VERSION, W, H, rings, compact);
+	for (size_t i = 0; i < count; ++i)
+		fprintf(g_record.f, "entry %s\n", entries[i].text);
+	g_record.t0_ns = monotonic_ns();
+	return 1;
 }
 
-static void keysym_columns_for_group(App *app, xcb_keycode_t kc, int group, xcb_keysym_t *col0, xcb_keysym_t *col1)
+static void record_event(const char *fmt, ...)
 {
-	int base = group * 2;
-	*col0 = xcb_key_symbols_get_keysym(app->keysyms, kc, base);
-	*col1 = xcb_key_symbols_get_keysym(app->keysyms, kc, base + 1);
+	if (!g_record.f) return;
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(g_record.f, "%lld ", (long long)((monotonic_ns() - g_record.t0_ns) / 1000));
+	vfprintf(g_record.f, fmt, ap);
+	fputc('\n', g_record.f);
+	va_end(ap);
+}
 
-	// If the requested group is out of range, fall back to group 0 mapping.
-	if (*col0 == XCB_NO_SYMBOL && *col1 == XCB_NO_SYMBOL && group != 0) {
-		*col0 = xcb_key_symbols_get_keysym(app->keysyms, kc, 0);
-		*col1 = xcb_key_symbols_get_keysym(app->keysyms, kc, 1);
-	}
+static void record_close(void)
+{
+	if (g_record.f) fclose(g_record.f);
+	g_record.f = NULL;
 }
 
-static xcb_keycode_t first_keycode_for_keysym(App *app, xcb_keysym_t sym, int group)
+static int run_replay(const char *path, int realtime)
 {
-	// Prefer a keycode whose first/shifted column already matches the
-	// requested keysym (avoids layout mixups like de-qwertz vs us-qwerty).
-	xcb_keycode_t kc = 0;
-	xcb_keycode_t *arr = xcb_key_symbols_get_keycode(app->keysyms, sym);
-	if (arr) {
-		for (xcb_keycode_t *p = arr; *p; ++p) {
-			xcb_keysym_t col0 = 0, col1 = 0;
-			keysym_columns_for_group(app, *p, group, &col0, &col1);
-			if (col0 == sym || col1 == sym) {
-				kc = *p;
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return 2;
+	}
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t r;
+	int version = 0, W = 0, H = 0, rings = 0, compact = 0;
+	Entry *entries = NULL;
+	size_t count = 0, ecap = 0;
+	int rc = 0;
+
+	// Header, comments and entries; the first line that is none of these
+	// ends the header
+	int pending = 0;
+	while ((r = getline(&line, &cap, f)) != -1) {
+		while (r > 0 && (line[r - 1] == '\n' || line[r - 1] == '\r'))
+			line[--r] = '\0';
+		if (line[0] == '#') {
+			continue;
+		} else if (!strncmp(line, "entry ", 6)) {
+			if (count == ecap) {
+				ecap = ecap ? ecap * 2 : 16;
+				Entry *tmp = (Entry *)realloc(entries, ecap * sizeof(Entry));
+				if (!tmp) {
+					rc = 1;
+					break;
+				}
+				entries = tmp;
+			}
+			entries[count] = (Entry){.text = strdup(line + 6)};
+			if (!entries[count++].text) {
+				rc = 1;
 				break;
 			}
-			if (!kc) kc = *p;
+		} else if (sscanf(line, "gzg-record %d", &version) == 1 || sscanf(line, "size %d %d", &W, &H) == 2
+		           || sscanf(line, "rings %d", &rings) == 1 || sscanf(line, "compact %d", &compact) == 1) {
+			continue;
+		} else {
+			pending = 1;
+			break;
 		}
-		free(arr);
 	}
-	return kc;
-}
-
-static int send_keysym_with_shift_if_needed(App *app, xcb_keysym_t sym, int group)
-{
-	xcb_keycode_t kc = first_keycode_for_keysym(app, sym, group);
-	if (!kc) {
-		DBG("[type] No keycode for keysym 0x%08x\n", (unsigned)sym);
-		return 0;
+	if (!rc && (version != RECORD_VERSION || W <= 0 || H <= 0 || count == 0)) {
+		fprintf(stderr, "%s: not a gzg-record %d log\n", path, RECORD_VERSION);
+		rc = 2;
 	}
 
-	xcb_keysym_t col0 = 0, col1 = 0;
-	keysym_columns_for_group(app, kc, group, &col0, &col1);
-	DBG("[type] group=%d sym=0x%08x kc=%u col0=0x%08x col1=0x%08x\n",
-	    group, (unsigned)sym, (unsigned)kc, (unsigned)col0, (unsigned)col1);
-
-	// If the keycode we found does not actually produce this keysym in the
-	// first two columns, bail so the caller can use Unicode fallback instead
-	// of typing the wrong character (e.g., y instead of z on qwertz).
-	if (sym != col0 && sym != col1) {
-		DBG("[type] keycode %u maps to col0=0x%08x col1=0x%08x (wanted 0x%08x)\n",
-		    (unsigned)kc, (unsigned)col0, (unsigned)col1, (unsigned)sym);
-		return 0;
+	cairo_surface_t *surf = NULL;
+	cairo_t *cr = NULL;
+	Histogram h_render = {0};
+	int64_t process_total_ns = 0;
+	long n_events = 0, n_renders = 0;
+	int sel = (int)count - 1;
+	int64_t wall0 = monotonic_ns();
+	int done = 0;
+
+	if (!rc) {
+		surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, W, H);
+		cr = cairo_create(surf);
+		cairo_set_antialias(cr, CAIRO_ANTIALIAS_FAST);
+		Scene sc = {.width = W, .height = H, .entries = entries, .n = (int)count, .hover_idx = sel,
+		            .rings = rings, .compact = compact};
+		render_scene(cr, &sc);  // the first frame, as rendered before mapping
+		cairo_surface_flush(surf);
 	}
 
-	int need_shift = (sym == col1 && sym != col0);
-	if (need_shift) {
-		xcb_keycode_t shift_kc = first_keycode_for_keysym(app, XK_Shift_L, 0);
-		if (!shift_kc) {
-			DBG("[type] Shift keycode missing; cannot shift\n");
-			return 0;
+	// Events
+	while (!rc && !done && (pending || getline(&line, &cap, f) != -1)) {
+		pending = 0;
+		long long t_us;
+		char kind[16];
+		int a = 0, b = 0, c = 0, nf = sscanf(line, "%lld %15s %i %i %i", &t_us, kind, &a, &b, &c);
+		if (nf < 2) continue;  // blank or unknown line
+		if (realtime) {
+			int64_t due = wall0 + t_us * 1000;
+			int64_t now = monotonic_ns();
+			if (due > now) sleep_us((int)((due - now) / 1000));
 		}
-		fake_key(app, 1, shift_kc);
-		fake_key(app, 1, kc);
-		fake_key(app, 0, kc);
-		fake_key(app, 0, shift_kc);
-	} else {
-		fake_key(app, 1, kc);
-		fake_key(app, 0, kc);
+
+		int64_t t0 = monotonic_ns();
+		int prev = sel, redraw = 0, resized = 0;
+		const char *outcome = NULL;
+		if (!strcmp(kind, "motion") && nf >= 4) {
+			sel = sector_index_from_point((int)count, rings, W, H, a, b);
+		} else if (!strcmp(kind, "press") && nf >= 5) {
+			if (a == 1 && compact && compact_outside(W, H, b, c)) {
+				outcome = "cancel";
+			} else if (a == 1) {
+				sel = sector_index_from_point((int)count, rings, W, H, b, c);
+				outcome = "select";
+			}
+		} else if (!strcmp(kind, "key") && nf >= 3) {
+			xcb_keysym_t sym = (xcb_keysym_t)a;
+			if (sym == XK_Escape || sym == 'q' || sym == 'Q')
+				outcome = "cancel";
+			else if (sym == XK_Return || sym == XK_KP_Enter)
+				outcome = "select";
+			else
+				sel = nav_apply(sym, sel, (int)count);
+		} else if (!strcmp(kind, "configure") && nf >= 4 && (a != W || b != H) && a > 0 && b > 0) {
+			W = a;
+			H = b;
+			cairo_destroy(cr);
+			cairo_surface_destroy(surf);
+			surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, W, H);
+			cr = cairo_create(surf);
+			cairo_set_antialias(cr, CAIRO_ANTIALIAS_FAST);
+			resized = 1;
+		}
+		redraw = !outcome && (resized || sel != prev);
+		int64_t t1 = monotonic_ns();
+		if (redraw) {
+			Scene sc = {.width = W, .height = H, .entries = entries, .n = (int)count, .hover_idx = sel,
+			            .rings = rings, .compact = compact};
+			render_scene(cr, &sc);
+			cairo_surface_flush(surf);
+			hist_record(&h_render, (monotonic_ns() - t1) / 1000);
+			++n_renders;
+		}
+		int64_t t2 = monotonic_ns();
+		process_total_ns += t1 - t0;
+		++n_events;
+		printf("{\"t_us\":%lld,\"event\":\"%s\",\"sel\":%d,\"process_ns\":%lld,\"render_us\":%.1f%s%s%s}\n",
+		       t_us, kind, sel, (long long)(t1 - t0), redraw ? (double)(t2 - t1) / 1e3 : 0.0,
+		       outcome ? ",\"outcome\":\"" : "", outcome ? outcome : "", outcome ? "\"" : "");
+		if (outcome) done = 1;
 	}
-	return 1;
+	if (!rc) {
+		printf("{\"replay\":\"%s\",\"events\":%ld,\"renders\":%ld,\"process_ns_mean\":%.1f,"
+		       "\"render_p50_ms\":%.3f,\"render_p99_ms\":%.3f,\"render_max_ms\":%.3f,\"wall_ms\":%.3f}\n",
+		       path, n_events, n_renders, n_events ? (double)process_total_ns / n_events : 0.0,
+		       (double)hist_percentile(&h_render, 50.0) / 1e3, (double)hist_percentile(&h_render, 99.0) / 1e3,
+		       (double)h_render.max_us / 1e3, (double)(monotonic_ns() - wall0) / 1e6);
+		fflush(stdout);
+	}
+
+	if (cr) cairo_destroy(cr);
+	if (surf) cairo_surface_destroy(surf);
+	free_entries(entries, count);
+	free(line);
+	fclose(f);
+	return rc;
 }
 
-static int unicode_hex_input(App *app, uint32_t cp, int group)
-{
-	DBG("[type] unicode_hex_input U+%04X\n", cp);
-	// Ctrl+Shift+u, then hex digits, then Return
-	xcb_keycode_t ctrl_kc  = first_keycode_for_keysym(app, XK_Control_L, 0);
-	xcb_keycode_t shift_kc = first_keycode_for_keysym(app, XK_Shift_L, 0);
-	if (!ctrl_kc || !shift_kc) {
-		DBG("[type] Missing modifier keycodes for Ctrl/Shift\n");
-		return 0;
-	}
+// --- Microbenchmarks (developer) -----------------------------------------
+// --bench NAME prints one JSON line per case:
+//   {"bench":NAME,"case":CASE,"rounds":R,"ops_per_round":K,
+//    "ns_per_op_median":..,"ns_per_op_min":..,"ns_per_op_mean":..}
+// Keep this format stable; results are diffed between commits.
+#define MICROBENCH_ROUNDS 15
 
-	// Press Ctrl+Shift
-	fake_key(app, 1, ctrl_kc);
-	fake_key(app, 1, shift_kc);
+typedef void (*BenchFn)(void *ctx, long ops);
 
-	// Press 'u'
-	if (!send_keysym_with_shift_if_needed(app, 'u', group)) {
-		DBG("[type] Could not send 'u' for Unicode preinput\n");
-	}
+static volatile uint64_t bench_sink;  // keeps results alive
 
-	// Release modifiers
-	fake_key(app, 0, shift_kc);
-	fake_key(app, 0, ctrl_kc);
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
 
-	// Type lowercase hex
-	char hex[9];
-	snprintf(hex, sizeof(hex), "%x", cp);
-	for (char *p = hex; *p; ++p) {
-		if (!send_keysym_with_shift_if_needed(app, (xcb_keysym_t)*p, group)) {
-			DBG("[type] Failed sending hex digit '%c'\n", *p);
-		}
+static void bench_run(const char *name, const char *cas, BenchFn fn, void *ctx, long ops)
+{
+	double r[MICROBENCH_ROUNDS], sum = 0.0;
+	fn(ctx, ops);  // warm-up
+	for (int i = 0; i < MICROBENCH_ROUNDS; ++i) {
+		int64_t t0 = monotonic_ns();
+		fn(ctx, ops);
+		r[i] = (double)(monotonic_ns() - t0) / (double)ops;
+		sum += r[i];
 	}
+	qsort(r, MICROBENCH_ROUNDS, sizeof(double), cmp_double);
+	printf("{\"bench\":\"%s\",\"case\":\"%s\",\"rounds\":%d,\"ops_per_round\":%ld,"
+	       "\"ns_per_op_median\":%.2f,\"ns_per_op_min\":%.2f,\"ns_per_op_mean\":%.2f}\n",
+	       name, cas, MICROBENCH_ROUNDS, ops, r[MICROBENCH_ROUNDS / 2], r[0], sum / MICROBENCH_ROUNDS);
+	fflush(stdout);
+}
 
-	// Commit
-	if (!send_keysym_with_shift_if_needed(app, XK_Return, group)) {
-		DBG("[type] Failed sending Return to commit Unicode\n");
+typedef struct
+{
+	cairo_surface_t *surf;
+	cairo_t *cr;
+	Scene sc;
+	Entry *entries;
+	int n, W, H;
+	uint8_t *pixels;
+	uint32_t len;
+	const char *text;
+	size_t text_len;
+	FrostOpts frost;
+} BenchCtx;
+
+static void bench_draw(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	for (long i = 0; i < ops; ++i) {
+		render_scene(b->cr, &b->sc);
+		cairo_surface_flush(b->surf);
 	}
-	return 1;
 }
 
-static void type_utf8_string(App *app, const char *s)
+static void bench_wedge_fill_raster(void *p, long ops)
 {
-	if (!s) return;
+	BenchCtx *b = (BenchCtx *)p;
+	for (long i = 0; i < ops; ++i)
+		fill_wedges_raster(b->cr, &b->sc);
+	cairo_surface_flush(b->surf);
+}
 
-	refresh_active_group(app);
-	int group = (int)app->active_group;
-	DBG("[type] Typing with active group %d\n", group);
+static void bench_wedge_fill_cairo(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	for (long i = 0; i < ops; ++i)
+		fill_wedges_cairo(b->cr, &b->sc);
+	cairo_surface_flush(b->surf);
+}
 
-	// Query XTEST just for logging
-	xcb_test_get_version_cookie_t vck = xcb_test_get_version(app->conn, 2, 2);
-	xcb_test_get_version_reply_t *vrep = xcb_test_get_version_reply(app->conn, vck, NULL);
-	if (vrep) {
-		DBG("[type] XTEST version %u.%u\n", vrep->major_version, vrep->minor_version);
-		free(vrep);
-	} else {
-		DBG("[type] XTEST version query failed\n");
+static void bench_fit_font_size(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	double acc = 0.0;
+	for (long i = 0; i < ops; ++i)
+		acc += fit_font_size(b->cr, b->entries[i % b->n].text, b->W * 0.25, b->H * 0.1);
+	bench_sink += (uint64_t)acc;
+}
+
+static void bench_sector_index(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	uint64_t acc = 0;
+	for (long i = 0; i < ops; ++i)
+		acc += (uint64_t)sector_index_from_point(b->n, b->sc.rings, b->W, b->H, (int)((i * 7919) % b->W), (int)((i * 104729) % b->H));
+	bench_sink += acc;
+}
+
+static void bench_rect_edge(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	double acc = 0.0, step = 2.0 * M_PI / (double)ops;
+	for (long i = 0; i < ops; ++i)
+		acc += distance_to_rect_edge(b->W, b->H, b->W * 0.5, b->H * 0.5, step * (double)i);
+	bench_sink += (uint64_t)acc;
+}
+
+// Converts in place, so later rounds see earlier output as input; only
+// the cost matters here.
+static void bench_screenshot_convert(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	for (long i = 0; i < ops; ++i) {
+		cairo_surface_t *img = screenshot_to_surface(NULL, b->pixels, b->len, b->W, b->H);
+		if (img) cairo_surface_destroy(img);
 	}
+}
 
-	DBG("[type] Typing string: \"%s\"\n", s);
+static void bench_screenshot_dim(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	for (long i = 0; i < ops; ++i) {
+		dim_and_mark_screenshot(b->surf, b->W, b->H, b->W / 2, b->H / 2, 1, NULL);
+		cairo_surface_flush(b->surf);
+	}
+}
 
-	const unsigned char *p = (const unsigned char *)s;
-	while (*p) {
-		uint32_t cp = 0xFFFD; // replacement
-		int len = 0;
-
-		if (p[0] < 0x80) { cp = p[0]; len = 1; }
-		else if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
-			cp = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F); len = 2;
-		}
-		else if ((p[0] & 0xF0) == 0xE0 &&
-		         (p[1] & 0xC0) == 0x80 &&
-		         (p[2] & 0xC0) == 0x80) {
-			cp = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F); len = 3;
-		}
-		else if ((p[0] & 0xF8) == 0xF0 &&
-		         (p[1] & 0xC0) == 0x80 &&
-		         (p[2] & 0xC0) == 0x80 &&
-		         (p[3] & 0xC0) == 0x80) {
-			cp = ((p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
-			len = 4;
-		} else {
-			len = 1; // invalid byte; send replacement via hex path
+// Frosts the same surface every round; only the cost matters here.
+static void bench_bg_effects(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	(void)ops;
+	frost_apply(b->surf, &b->frost);
+}
+
+// The per-character work of type_utf8_string() without any X traffic.
+static void bench_utf8_decode(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	uint64_t acc = 0;
+	long done = 0;
+	while (done < ops) {
+		const unsigned char *s = (const unsigned char *)b->text;
+		while (*s && done < ops) {
+			uint32_t cp;
+			s += utf8_decode(s, &cp);
+			acc += keysym_for_codepoint(cp);
+			++done;
 		}
+	}
+	bench_sink += acc;
+}
 
-		DBG("[type] sending U+%04X\n", cp);
+static void bench_stdin(void *p, long ops)
+{
+	BenchCtx *b = (BenchCtx *)p;
+	(void)ops;
+	FILE *f = fmemopen((void *)b->text, b->text_len, "r");
+	if (!f) return;
+	Entry *entries = NULL;
+	size_t count = 0;
+	if (read_entries(f, &entries, &count)) free_entries(entries, count);
+	fclose(f);
+	bench_sink += count;
+}
 
-		int sent = 0;
-		if (cp == '\n') {
-			sent = send_keysym_with_shift_if_needed(app, XK_Return, group);
-		} else if (cp == '\t') {
-			sent = send_keysym_with_shift_if_needed(app, XK_Tab, group);
-		} else if (cp >= 0x20 && cp <= 0x7E) {
-			// Try ASCII directly (with Shift if needed)
-			sent = send_keysym_with_shift_if_needed(app, (xcb_keysym_t)cp, group);
-		} else {
-			// Fallback: Unicode hex input
-			sent = unicode_hex_input(app, cp, group);
+static int run_microbench(const char *name, const RenderOpts *ro)
+{
+	int all = !strcmp(name, "all");
+	int ran = 0;
+	char cas[64];
+	BenchCtx b = {0};
+	b.W = ro->width;
+	b.H = ro->height;
+	b.n = ro->synthetic > 0 ? ro->synthetic : 8;
+	b.entries = synthetic_entries(b.n);
+	if (!b.entries) return 1;
+	b.surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, b.W, b.H);
+	b.cr = cairo_create(b.surf);
+	cairo_set_antialias(b.cr, CAIRO_ANTIALIAS_FAST);
+	b.sc = (Scene){.width = b.W, .height = b.H, .entries = b.entries, .n = b.n, .hover_idx = b.n - 1,
+	               .rings = ro->rings ? ring_count_for(b.n) : 0};
+	if (b.sc.rings)
+		snprintf(cas, sizeof(cas), "n=%d rings=%d %dx%d", b.n, b.sc.rings, b.W, b.H);
+	else
+		snprintf(cas, sizeof(cas), "n=%d %dx%d", b.n, b.W, b.H);
+
+	if (all || !strcmp(name, "draw")) {
+		bench_run("draw", cas, bench_draw, &b, 1);
+		ran = 1;
+	}
+	if (all || !strcmp(name, "wedge_fill")) {
+		// The same wedges through the span rasterizer and as cairo paths
+		// (wedge layout only)
+		char c2[80];
+		if (!b.sc.rings) {
+			snprintf(c2, sizeof(c2), "raster %s", cas);
+			bench_run("wedge_fill", c2, bench_wedge_fill_raster, &b, 1);
+			snprintf(c2, sizeof(c2), "cairo %s", cas);
+			bench_run("wedge_fill", c2, bench_wedge_fill_cairo, &b, 1);
+		}
+		ran = 1;
+	}
+	if (all || !strcmp(name, "fit_font_size")) {
+		cairo_select_font_face(b.cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+		bench_run("fit_font_size", cas, bench_fit_font_size, &b, 200);
+		ran = 1;
+	}
+	if (all || !strcmp(name, "sector_index_from_point")) {
+		bench_run("sector_index_from_point", cas, bench_sector_index, &b, 1L << 20);
+		ran = 1;
+	}
+	if (all || !strcmp(name, "distance_to_rect_edge")) {
+		bench_run("distance_to_rect_edge", cas, bench_rect_edge, &b, 1L << 20);
+		ran = 1;
+	}
+	if (all || !strcmp(name, "screenshot_convert")) {
+		size_t len = (size_t)b.W * b.H * 4;
+		uint8_t *px = (uint8_t *)malloc(len);
+		if (px) {
+			for (size_t i = 0; i < len; ++i)
+				px[i] = (uint8_t)(i * 131u);
+			b.pixels = px;
+			for (int bpp = 3; bpp <= 4; ++bpp) {
+				b.len = (uint32_t)((size_t)b.W * b.H * bpp);
+				snprintf(cas, sizeof(cas), "bpp=%d %dx%d", bpp, b.W, b.H);
+				bench_run("screenshot_convert", cas, bench_screenshot_convert, &b, 1);
+			}
+			free(px);
+			b.pixels = NULL;
+		}
+		ran = 1;
+	}
+	if (all || !strcmp(name, "screenshot_dim")) {
+		snprintf(cas, sizeof(cas), "%dx%d", b.W, b.H);
+		bench_run("screenshot_dim", cas, bench_screenshot_dim, &b, 1);
+		ran = 1;
+	}
+	if (all || !strcmp(name, "bg_effects")) {
+		// One op is one pixel, so ns per op reads as ms per megapixel.
+		int cores = frost_threads(0);
+		b.frost = (FrostOpts){.enabled = 1, .desaturate = 0.5, .threads = 1};
+		snprintf(cas, sizeof(cas), "threads=1 %dx%d", b.W, b.H);
+		bench_run("bg_effects", cas, bench_bg_effects, &b, (long)b.W * b.H);
+		if (cores > 1) {
+			b.frost.threads = cores;
+			snprintf(cas, sizeof(cas), "threads=%d %dx%d", cores, b.W, b.H);
+			bench_run("bg_effects", cas, bench_bg_effects, &b, (long)b.W * b.H);
+		}
+		ran = 1;
+	}
+	if (all || !strcmp(name, "utf8_decode")) {
+		size_t total = 0;
+		for (size_t i = 0; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); ++i)
+			total += strlen(bench_corpora[i].text);
+		char *buf = (char *)malloc(total + 1);
+		if (buf) {
+			buf[0] = '\0';
+			for (size_t i = 0; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); ++i)
+				strcat(buf, bench_corpora[i].text);
+			b.text = buf;
+			bench_run("utf8_decode", "all corpora", bench_utf8_decode, &b, 1L << 20);
+			free(buf);
+			b.text = NULL;
+		}
+		ran = 1;
+	}
+	if (all || !strcmp(name, "stdin")) {
+		int lines = ro->synthetic > 0 ? ro->synthetic : 10000;
+		size_t cap = (size_t)lines * 24 + 1, len = 0;
+		char *buf = (char *)malloc(cap);
+		if (buf) {
+			for (int i = 0; i < lines; ++i)
+				len += (size_t)snprintf(buf + len, cap - len, "Entry number %d\n", i + 1);
+			b.text = buf;
+			b.text_len = len;
+			snprintf(cas, sizeof(cas), "lines=%d", lines);
+			// One op is one line: bench_stdin parses the whole buffer per call.
+			bench_run("stdin", cas, bench_stdin, &b, lines);
+			free(buf);
+			b.text = NULL;
 		}
+		ran = 1;
+	}
 
-		if (!sent) DBG("[type] Failed to send U+%04X; skipping\n", cp);
+	cairo_destroy(b.cr);
+	cairo_surface_destroy(b.surf);
+	free_entries(b.entries, (size_t)b.n);
+	if (!ran) {
+		fprintf(stderr, "Unknown benchmark: %s\n", name);
+		return 2;
+	}
+	return 0;
+}
 
-		p += len;
+// A selection ends the session. --type and --paste keep a copy of the text
+// (and the event time) for after teardown; otherwise it is printed now.
+static void select_entry(const Entry *e, int defer, xcb_timestamp_t time, char **type_text,
+                         xcb_timestamp_t *select_time)
+{
+	if (defer) {
+		*type_text = strdup(e->text);
+		*select_time = time;
+		DBG("[piewin] (type/paste mode) storing text: \"%s\"\n", *type_text);
+	} else {
+		fprintf(stdout, "%s\n", e->text);
+		fflush(stdout);
+		DBG("[piewin] SELECT \"%s\"\n", e->text);
 	}
-	xcb_flush(app->conn);
-	release_all_keys(app);
 }
 
 int main(int argc, char **argv)
 {
 	int keep_mouse_pos = 0;
 	int use_screenshot_bg = 0;
+	int server_screenshot = 0;
+	FrostOpts frost = {0};
+	int marking = 0;
+	int low_bandwidth = 0;
+	int override_redirect = 0;
+	int compact_radius = COMPACT_DEFAULT_RADIUS;
 	int allow_multiple = 0;
 	int kb_enabled = 1;
 	int type_mode = 0;
+	int type_hex = 0;
+	int paste_mode = 0;
+	const char *paste_chord = PASTE_DEFAULT_CHORD;
+	xcb_timestamp_t select_time = XCB_CURRENT_TIME;
+	const char *bench_type = NULL;
+	const char *bench_receive = NULL;
+	const char *microbench = NULL;
+	const char *record_path = NULL, *replay_path = NULL;
+	int replay_realtime = 0;
+	int stats = 0;
+	RenderOpts render = {.width = 1920, .height = 1080, .hover_idx = -1};
 	char *type_text = NULL;
 	int lock_fd = -1;
 	double timeout_sec = 10.0;
 
+	trace_init();
+	xstats_init();
+	xstats_phase(NULL, "init");
+	int64_t startup_t = trace_begin();
+	int64_t t;
+
 	// Args
 	for (int i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
@@ -908,12 +5126,129 @@ int main(int argc, char **argv)
 			keep_mouse_pos = 1;
 		} else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--screenshot")) {
 			use_screenshot_bg = 1;
+		} else if (!strcmp(argv[i], "-ss") || !strcmp(argv[i], "--server-screenshot")) {
+			use_screenshot_bg = 1;
+			server_screenshot = 1;
+		} else if (!strcmp(argv[i], "-fg") || !strcmp(argv[i], "--frosted")) {
+			use_screenshot_bg = 1;
+			frost.enabled = 1;
+		} else if (!strcmp(argv[i], "--desaturate")) {
+			char *end = NULL;
+			long v = (i + 1 < argc) ? strtol(argv[i + 1], &end, 10) : -1;
+			if (!end || *end || v < 0 || v > 100) {
+				fprintf(stderr, "--desaturate requires a percentage (0-100)\n");
+				return 2;
+			}
+			frost.desaturate = (double)v / 100.0;
+			++i;
+		} else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--compact")) {
+			render.compact = 1;
+		} else if (!strcmp(argv[i], "--radius")) {  // implies -c
+			char *end = NULL;
+			long v = (i + 1 < argc) ? strtol(argv[i + 1], &end, 10) : 0;
+			if (!end || *end || v < 32 || v > 8192) {
+				fprintf(stderr, "--radius requires a number of pixels (32-8192)\n");
+				return 2;
+			}
+			compact_radius = (int)v;
+			render.compact = 1;
+			++i;
+		} else if (!strcmp(argv[i], "-or") || !strcmp(argv[i], "--override-redirect")) {
+			override_redirect = 1;
+		} else if (!strcmp(argv[i], "-lb") || !strcmp(argv[i], "--low-bandwidth")) {
+			low_bandwidth = 1;
+		} else if (!strcmp(argv[i], "-mm") || !strcmp(argv[i], "--marking")) {
+			marking = 1;
+		} else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rings")) {
+			render.rings = 1;
 		} else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--multiple")) {
 			allow_multiple = 1;
 		} else if (!strcmp(argv[i], "-nkb") || !strcmp(argv[i], "--no-keyboard")) {
 			kb_enabled = 0;
 		} else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--type")) {
 			type_mode = 1;
+		} else if (!strcmp(argv[i], "--type-hex")) {
+			type_hex = 1;
+		} else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--paste")) {
+			paste_mode = 1;
+		} else if (!strcmp(argv[i], "--paste-chord")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "--paste-chord requires an argument\n");
+				return 2;
+			}
+			xcb_keysym_t mods[4], key;
+			if (parse_paste_chord(argv[++i], mods, 4, &key) < 0) {
+				fprintf(stderr, "Invalid --paste-chord value: %s\n", argv[i]);
+				return 2;
+			}
+			paste_chord = argv[i];
+		} else if (!strcmp(argv[i], "--stats")) {
+			if (!stats) stats = 1;
+		} else if (!strcmp(argv[i], "--stats-overlay")) {
+			stats = 2;
+		} else if (!strcmp(argv[i], "--render-png") || !strcmp(argv[i], "--render-compare")
+		           || !strcmp(argv[i], "--entries-file")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "%s requires a path\n", argv[i]);
+				return 2;
+			}
+			if (!strcmp(argv[i], "--render-png"))
+				render.png_out = argv[++i];
+			else if (!strcmp(argv[i], "--render-compare"))
+				render.golden = argv[++i];
+			else
+				render.entries_file = argv[++i];
+		} else if (!strcmp(argv[i], "--render-bench") || !strcmp(argv[i], "--hover")
+		           || !strcmp(argv[i], "--synthetic")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "%s requires a number\n", argv[i]);
+				return 2;
+			}
+			char *end = NULL;
+			long v = strtol(argv[i + 1], &end, 10);
+			if (!end || *end || v < 0 || v > 100000) {
+				fprintf(stderr, "Invalid %s value: %s\n", argv[i], argv[i + 1]);
+				return 2;
+			}
+			if (!strcmp(argv[i], "--render-bench"))
+				render.frames = (int)v;
+			else if (!strcmp(argv[i], "--hover"))
+				render.hover_idx = (int)v;
+			else
+				render.synthetic = (int)v;
+			++i;
+		} else if (!strcmp(argv[i], "--size")) {
+			if (i + 1 >= argc || !parse_size(argv[i + 1], &render.width, &render.height)) {
+				fprintf(stderr, "--size requires WIDTHxHEIGHT\n");
+				return 2;
+			}
+			++i;
+		} else if (!strcmp(argv[i], "--bench")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "--bench requires a benchmark name\n");
+				return 2;
+			}
+			microbench = argv[++i];
+		} else if (!strcmp(argv[i], "--bench-type") || !strcmp(argv[i], "--bench-type-receiver")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "%s requires a corpus name\n", argv[i]);
+				return 2;
+			}
+			if (!strcmp(argv[i], "--bench-type"))
+				bench_type = argv[++i];
+			else
+				bench_receive = argv[++i];
+		} else if (!strcmp(argv[i], "--record") || !strcmp(argv[i], "--replay")) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "%s requires a file\n", argv[i]);
+				return 2;
+			}
+			if (!strcmp(argv[i], "--record"))
+				record_path = argv[++i];
+			else
+				replay_path = argv[++i];
+		} else if (!strcmp(argv[i], "--replay-realtime")) {
+			replay_realtime = 1;
 		} else if (!strcmp(argv[i], "--timeout")) {
 			if (i + 1 >= argc) {
 				fprintf(stderr, "--timeout requires an argument\n");
@@ -937,10 +5272,17 @@ int main(int argc, char **argv)
 	if (dbg_enabled()) {
 		fprintf(stderr, "[piewin] Cairo: %s\n", cairo_version_string());
 		fprintf(stderr,
-		        "[piewin] keep_mouse_pos=%d screenshot=%d allow_multiple=%d kb_enabled=%d type_mode=%d timeout=%.1fs\n",
-		        keep_mouse_pos, use_screenshot_bg, allow_multiple, kb_enabled, type_mode, timeout_sec);
+		        "[piewin] keep_mouse_pos=%d screenshot=%d server_screenshot=%d frosted=%d allow_multiple=%d kb_enabled=%d type_mode=%d type_hex=%d paste_mode=%d stats=%d timeout=%.1fs\n",
+		        keep_mouse_pos, use_screenshot_bg, server_screenshot, frost.enabled, allow_multiple, kb_enabled, type_mode, type_hex, paste_mode, stats, timeout_sec);
 	}
 
+	// Developer benchmarks run without UI, lock or stdin
+	if (bench_receive) return run_type_receiver(bench_receive);
+	if (bench_type) return run_type_bench(bench_type, type_hex);
+	if (microbench) return run_microbench(microbench, &render);
+	if (replay_path) return run_replay(replay_path, replay_realtime);
+	if (is_headless(&render)) return run_render(&render);
+
 	// Single-instance lock (per user + DISPLAY), unless --multiple
 	if (!allow_multiple) {
 		char disp_s[128];
@@ -951,7 +5293,9 @@ int main(int argc, char **argv)
 		         (unsigned)getuid(), disp_s);
 		DBG("[piewin] Using lockfile %s (DISPLAY=%s)\n",
 		    disp_lock, disp ? disp : ":0");
+		t = trace_begin();
 		int rv = acquire_lockfile(disp_lock);
+		trace_end("lock", t);
 		if (rv == -2) {
 			fprintf(stderr,
 			        "Another instance appears to be running (lock %s).\n"
@@ -968,34 +5312,11 @@ int main(int argc, char **argv)
 	}
 
 	// Read entries from stdin (fast, simple)
+	t = trace_begin();
 	Entry *entries = NULL;
-	size_t cap = 0, count = 0;
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t r;
-	while ((r = getline(&line, &len, stdin)) != -1) {
-		// Trim newline(s)
-		while (r > 0 && (line[r - 1] == '\n' || line[r - 1] == '\r')) {
-			line[--r] = '\0';
-		}
-		if (r == 0) continue;  // skip empty lines
-		if (count == cap) {
-			cap = cap ? cap * 2 : 8;
-			entries = (Entry *)realloc(entries, cap * sizeof(Entry));
-			if (!entries) {
-				perror("realloc");
-				return 1;
-			}
-		}
-		entries[count].text = strndup(line, r);
-		if (!entries[count].text) {
-			perror("strndup");
-			return 1;
-		}
-		DBG("[piewin] Read entry[%zu]: \"%s\"\n", count, entries[count].text);
-		count++;
-	}
-	free(line);
+	size_t count = 0;
+	if (!read_entries(stdin, &entries, &count)) return 1;
+	trace_end("stdin", t);
 
 	DBG("[piewin] Total entries read: %zu\n", count);
 	if (count == 0) {
@@ -1006,6 +5327,8 @@ int main(int argc, char **argv)
 
 	// XCB setup
 	int scrno = 0;
+	xstats_phase(NULL, "connect");
+	t = trace_begin();
 	xcb_connection_t *conn = xcb_connect(NULL, &scrno);
 	if (xcb_connection_has_error(conn)) {
 		fprintf(stderr, "Failed to connect to X server.\n");
@@ -1017,6 +5340,8 @@ int main(int argc, char **argv)
 	for (int s = 0; s < scrno; ++s)
 		xcb_screen_next(&it);
 	xcb_screen_t *screen = it.data;
+	trace_end("connect", t);
+	xstats_phase(conn, "setup");
 	DBG("[piewin] Connected to X server: screen=%d size=%dx%d root=0x%08x\n",
 	    scrno,
 	    screen->width_in_pixels,
@@ -1030,6 +5355,28 @@ int main(int argc, char **argv)
 	app.height = screen->height_in_pixels;
 	app.min_keycode = setup->min_keycode;
 	app.max_keycode = setup->max_keycode;
+	app.type_remap = !type_hex;
+	app.server_side = server_screenshot;
+	app.frost = frost;
+	if (server_screenshot) g_xstats.backend = "cairo-xcb-server";
+	if (low_bandwidth) {
+		set_quality(&app, QUALITY_LOW, "forced");
+	} else if (display_is_remote(getenv("DISPLAY"))) {
+		set_quality(&app, QUALITY_LOW, "remote display");
+	} else {
+		set_quality(&app, QUALITY_FULL, "local display");
+		app.auto_quality = 1;
+	}
+	// -ss copies the screen on the server, so it costs no bandwidth
+	if (app.quality == QUALITY_LOW && use_screenshot_bg && !server_screenshot) {
+		DBG("[piewin] Screenshot background disabled at low-bandwidth quality\n");
+		use_screenshot_bg = 0;
+	}
+	// Strokes select by direction, so marking mode keeps one wedge per entry.
+	app.rings = (render.rings && !marking) ? ring_count_for((int)count) : 0;
+	app.stats.enabled = stats > 0;
+	app.stats.overlay = stats > 1;
+	t = trace_begin();
 	app.WM_PROTOCOLS = intern_atom(conn, "WM_PROTOCOLS", 0);
 	app.WM_DELETE_WINDOW = intern_atom(conn, "WM_DELETE_WINDOW", 0);
 	app.NET_WM_STATE = intern_atom(conn, "_NET_WM_STATE", 0);
@@ -1037,15 +5384,19 @@ int main(int argc, char **argv)
 	app.NET_WM_NAME = intern_atom(conn, "_NET_WM_NAME", 0);
 	app.WM_NAME_ATOM = intern_atom(conn, "WM_NAME", 0);
 	app.UTF8_STRING = intern_atom(conn, "UTF8_STRING", 1);
+	trace_end("atoms", t);
+	t = trace_begin();
 	app.keysyms = xcb_key_symbols_alloc(conn);
 	init_xkb(&app);
+	trace_end("keyboard-init", t);
 
 	// Always query pointer to know original position (for screenshot marker and/or restore)
 	int saved_root_x = 0, saved_root_y = 0;
 	int saved_pos_valid = 0;
 	{
+		t = trace_begin();
 		xcb_query_pointer_cookie_t qpc = xcb_query_pointer(conn, screen->root);
-		xcb_query_pointer_reply_t *qpr = xcb_query_pointer_reply(conn, qpc, NULL);
+		xcb_query_pointer_reply_t *qpr = xstats_reply(xcb_query_pointer_reply(conn, qpc, NULL));
 		if (qpr) {
 			saved_root_x = qpr->root_x;
 			saved_root_y = qpr->root_y;
@@ -1055,15 +5406,53 @@ int main(int argc, char **argv)
 		} else {
 			DBG("[piewin] QueryPointer failed.\n");
 		}
+		trace_end("query-pointer", t);
+	}
+
+	// Compact: a square around the pointer, kept on the pointer's monitor.
+	// It must not be placed or resized by the WM, so it is override-redirect.
+	if (render.compact) {
+		int px = saved_pos_valid ? saved_root_x : app.width / 2;
+		int py = saved_pos_valid ? saved_root_y : app.height / 2;
+		int mx = 0, my = 0, mw = app.width, mh = app.height;
+		monitor_at(&app, px, py, &mx, &my, &mw, &mh);
+		int d = 2 * compact_radius;
+		if (d > mw) d = mw;
+		if (d > mh) d = mh;
+		app.x = px - d / 2 < mx ? mx : (px - d / 2 > mx + mw - d ? mx + mw - d : px - d / 2);
+		app.y = py - d / 2 < my ? my : (py - d / 2 > my + mh - d ? my + mh - d : py - d / 2);
+		app.width = app.height = d;
+		app.compact = 1;
+		override_redirect = 1;
+		DBG("[piewin] Compact window %dx%d+%d+%d\n", d, d, app.x, app.y);
+	} else if (override_redirect) {
+		// Without a WM to place and size the window, cover the pointer's monitor
+		if (monitor_at(&app, saved_root_x, saved_root_y, &app.x, &app.y, &app.width, &app.height))
+			DBG("[piewin] Override-redirect on monitor %dx%d+%d+%d\n", app.width, app.height, app.x, app.y);
+		else
+			DBG("[piewin] No RandR 1.5 monitors; override-redirect covers the whole screen\n");
+	}
+
+	if (app.quality != QUALITY_LOW) {
+		t = trace_begin();
+		load_icons(entries, count, icon_size_for((int)count, app.rings, app.width, app.height));
+		trace_end("icons", t);
 	}
 
 	// Capture screenshot BEFORE creating/mapping our window (to avoid capturing ourselves)
 	if (use_screenshot_bg) {
 		app.bg_w = app.width;
 		app.bg_h = app.height;
-		app.bg_image = capture_dimmed_screenshot_with_cursor(&app,
-		                                                     saved_root_x, saved_root_y,
-		                                                     saved_pos_valid);
+		xstats_phase(conn, "screenshot");
+		t = trace_begin();
+		if (server_screenshot)
+			app.bg_image = capture_server_screenshot(&app, scrno, saved_root_x - app.x, saved_root_y - app.y,
+			                                         saved_pos_valid);
+		else
+			app.bg_image = capture_dimmed_screenshot_with_cursor(&app,
+			                                                     saved_root_x - app.x, saved_root_y - app.y,
+			                                                     saved_pos_valid);
+		trace_end("screenshot", t);
 		if (!app.bg_image) {
 			DBG("[piewin] Screenshot not available; falling back to solid background.\n");
 		}
@@ -1077,47 +5466,111 @@ int main(int argc, char **argv)
 		XCB_EVENT_MASK_POINTER_MOTION |
 		XCB_EVENT_MASK_KEY_PRESS;
 
-	uint32_t vals[2];
-	vals[0] = screen->black_pixel;
-	vals[1] = event_mask;
-
+	// In marking mode nothing is drawn until the pointer dwells, so leave
+	// the screen contents in place instead of clearing to black.
+	// Override-redirect skips the WM entirely: the window maps at once at
+	// its final geometry, so there is no reparenting, fullscreen
+	// ConfigureNotify or second draw, and the grabs succeed right away.
+	uint32_t vals[3];
+	int nv = 0;
+	vals[nv++] = marking ? XCB_BACK_PIXMAP_NONE : screen->black_pixel;
+	if (override_redirect) vals[nv++] = 1;
+	vals[nv++] = event_mask;
+	uint32_t value_mask = (marking ? XCB_CW_BACK_PIXMAP : XCB_CW_BACK_PIXEL) | XCB_CW_EVENT_MASK;
+	if (override_redirect) value_mask |= XCB_CW_OVERRIDE_REDIRECT;
+
+	xstats_phase(conn, "window");
+	t = trace_begin();
 	app.win = xcb_generate_id(conn);
-	xcb_create_window(conn, XCB_COPY_FROM_PARENT, app.win, screen->root, 0, 0, app.width, app.height, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, vals);
+	xcb_create_window(conn, XCB_COPY_FROM_PARENT, app.win, screen->root, app.x, app.y, app.width, app.height, 0,
+	                  XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, value_mask, vals);
 
 	set_wm_delete_protocol(&app);
-	set_fullscreen_hint(&app);
+	if (!override_redirect) set_fullscreen_hint(&app);
 	set_window_title(&app, "gzg");
 
-	// Map and raise
-	xcb_map_window(conn, app.win);
-	xcb_flush(conn);
+	// Remember who had focus so typing/pasting can wait for it to return.
+	xcb_get_input_focus_cookie_t prev_focus_ck = {0};
+	if (type_mode || paste_mode) prev_focus_ck = xcb_get_input_focus(conn);
+	trace_end("window-create", t);
 
 	// Create cairo surfaces (includes back buffer)
+	t = trace_begin();
 	recreate_cairo(&app);
+	trace_end("cairo-setup", t);
 
-	// Grab input so clicks/keys don't leak to other apps
-	grab_input(&app, kb_enabled);
+	int sel_idx = (int)count - 1;
+	int pressed_idx = -1;
+	int menu_shown = !marking;
+
+	// Render the first frame while the window is still unmapped, at the
+	// geometry it will have; the Expose after mapping only presents it.
+	if (menu_shown) {
+		DBG("[piewin] Initial render %dx%d, entries=%zu\n", app.width, app.height, count);
+		xstats_phase(conn, "first-render");
+		t = trace_begin();
+		render_frame(&app, entries, (int)count, sel_idx);
+		trace_end("first-render", t);
+	}
 
-	// Handle pointer warp unless disabled
+	// Warp before mapping: the warp only needs the root, and once the window
+	// is mapped every motion event must already be relative to the centre
+	// (marking mode measures strokes from there). Doing it after the grab
+	// round trips let pre-warp positions through as instant strokes.
 	if (!keep_mouse_pos) {
-		int cx = app.width / 2;
-		int cy = app.height / 2;
+		int cx = app.x + app.width / 2;
+		int cy = app.y + app.height / 2;
 		DBG("[piewin] Warping pointer to center %d,%d\n", cx, cy);
 		xcb_warp_pointer(conn, XCB_NONE, screen->root, 0, 0, 0, 0, cx, cy);
-		xcb_flush(conn);
 	}
 
-	int sel_idx = (int)count - 1;
-	int pressed_idx = -1;
-	DBG("[piewin] Initial draw %dx%d, entries=%zu\n", app.width, app.height, count);
-	draw(&app, entries, (int)count, sel_idx);
+	// Map and raise
+	xstats_phase(conn, "map");
+	t = trace_begin();
+	xcb_map_window(conn, app.win);
+	xcb_flush(conn);
+	trace_end("window-map", t);
+
+	// Grab input so clicks/keys don't leak to other apps
+	t = trace_begin();
+	grab_input(&app, kb_enabled, override_redirect);
+	trace_end("grab", t);
+
+	// Marking mode: strokes are measured from where the pointer started
+	// (the warp above precedes the map), so the first motion event
+	// already carries the whole stroke. The menu is drawn on dwell only.
+	int mark_ox = keep_mouse_pos ? saved_root_x - app.x : app.width / 2;
+	int mark_oy = keep_mouse_pos ? saved_root_y - app.y : app.height / 2;
+	int mark_x = mark_ox, mark_y = mark_oy;
+	int mark_commit = (int)(MARK_COMMIT_FRAC * (app.width < app.height ? app.width : app.height));
+	int64_t dwell_deadline_ns = monotonic_ns() + (int64_t)MARK_DWELL_MS * 1000000LL;
+
+	if (!menu_shown)
+		DBG("[piewin] Marking mode: origin %d,%d, commit radius %d\n", mark_ox, mark_oy, mark_commit);
+	trace_end("startup", startup_t);
+	xstats_phase(conn, "interactive");
+
+	if (record_path && !record_open(record_path, app.width, app.height, app.rings, app.compact, entries, count)) {
+		// Keep going; the menu matters more than the log
+		record_path = NULL;
+	}
+
+	// From here on frames are drawn on the render thread; app.width/height
+	// belong to it, the loop hit-tests against its own copy.
+	int win_w = app.width, win_h = app.height;
+	renderer_start(&app, entries, (int)count, sel_idx);
 
 	int exit_code = 1;  // default to "cancel"
 	int running = 1;
+	xcb_rectangle_t damage[EXPOSE_MAX_RECTS];  // Expose series collected until count == 0
+	int n_damage = 0;
+	int64_t input_ns = 0;  // arrival of the input event being handled, for --stats
 	int xfd = xcb_get_file_descriptor(conn);
 	int64_t timeout_deadline_ns = monotonic_ns() + (int64_t)(timeout_sec * 1000000000.0);
 
 	while (running) {
+		if (app.stats.enabled) stats_poll_completion(&app);
+
 		// Enforce timeout even if no events arrive
 		int64_t now_ns = monotonic_ns();
 		if (now_ns >= timeout_deadline_ns) {
@@ -1126,16 +5579,26 @@ int main(int argc, char **argv)
 			break;
 		}
 
+		if (!menu_shown && now_ns >= dwell_deadline_ns) {
+			menu_shown = 1;
+			int idx = mark_index((int)count, mark_ox, mark_oy, mark_x, mark_y);
+			if (idx >= 0) sel_idx = idx;
+			DBG("[piewin] Dwell at %d,%d; drawing menu (sel_idx=%d)\n", mark_x, mark_y, sel_idx);
+			renderer_post(&app, sel_idx, 0);
+		}
+
 		// Drain queued events first
 		xcb_generic_event_t *ev = xcb_poll_for_event(conn);
 		if (!ev) {
-			int wait_ms = (int)((timeout_deadline_ns - now_ns + 999999LL) / 1000000LL);
+			int64_t wake_ns = (menu_shown || dwell_deadline_ns > timeout_deadline_ns) ? timeout_deadline_ns : dwell_deadline_ns;
+			int wait_ms = (int)((wake_ns - now_ns + 999999LL) / 1000000LL);
 			if (wait_ms < 0) wait_ms = 0;
 
 			if (xfd >= 0) {
 				struct pollfd pfd = { .fd = xfd, .events = POLLIN, .revents = 0 };
 				int rv = poll(&pfd, 1, wait_ms);
 				if (rv == 0) {
+					if (!menu_shown) continue;  // dwell elapsed
 					DBG("[piewin] Timeout reached while idle; exiting\n");
 					exit_code = 1;
 					break;
@@ -1162,24 +5625,50 @@ int main(int argc, char **argv)
 			}
 		}
 		uint8_t rt = ev->response_type & ~0x80;
+		if (app.stats.enabled) {
+			// Input events start the latency clock; the blit of a frame they cause stops it.
+			int input = rt == XCB_MOTION_NOTIFY || rt == XCB_BUTTON_PRESS || rt == XCB_KEY_PRESS;
+			input_ns = input ? monotonic_ns() : 0;
+		}
 
 		switch (rt) {
 			case XCB_EXPOSE:
 				{
-					DBG("[piewin] EXPOSE\n");
-					draw(&app, entries, (int)count, sel_idx);
+					xcb_expose_event_t *e = (xcb_expose_event_t *)ev;
+					DBG("[piewin] EXPOSE %ux%u+%u+%u count=%u\n", e->width, e->height, e->x, e->y, e->count);
+					if (!menu_shown) break;
+					damage_add(damage, &n_damage, e->x, e->y, e->width, e->height);
+					if (e->count > 0) break;  // more of this series follows
+					renderer_expose(&app, damage, n_damage);
+					n_damage = 0;
 				}
 				break;
 
 			case XCB_MOTION_NOTIFY:
 				{
 					xcb_motion_notify_event_t *e = (xcb_motion_notify_event_t *)ev;
-					int idx = sector_index_from_point((int)count, app.width, app.height, e->event_x, e->event_y);
+					record_event("motion %d %d", e->event_x, e->event_y);
+					if (!menu_shown) {
+						mark_x = e->event_x;
+						mark_y = e->event_y;
+						dwell_deadline_ns = monotonic_ns() + (int64_t)MARK_DWELL_MS * 1000000LL;
+						int dx = mark_x - mark_ox, dy = mark_y - mark_oy;
+						if (dx * dx + dy * dy < mark_commit * mark_commit) break;
+						// The commit radius can be inside the dead zone on tiny windows
+						int idx = mark_index((int)count, mark_ox, mark_oy, mark_x, mark_y);
+						if (idx < 0) break;
+						DBG("[piewin] MARK stroke crossed commit radius -> idx=%d\n", idx);
+						select_entry(&entries[idx], type_mode || paste_mode, e->time, &type_text, &select_time);
+						exit_code = 0;
+						running = 0;
+						break;
+					}
+					int idx = sector_index_from_point((int)count, app.rings, win_w, win_h, e->event_x, e->event_y);
 					if (idx != sel_idx) {
 						DBG("[piewin] MOTION selects %d (from %d) at %d,%d\n",
 						    idx, sel_idx, e->event_x, e->event_y);
 						sel_idx = idx;
-						draw(&app, entries, (int)count, sel_idx);
+						renderer_post(&app, sel_idx, input_ns);
 					}
 				}
 				break;
@@ -1189,18 +5678,18 @@ int main(int argc, char **argv)
 					xcb_button_press_event_t *e = (xcb_button_press_event_t *)ev;
 					DBG("[piewin] BUTTON_PRESS detail=%u at %d,%d\n",
 					    e->detail, e->event_x, e->event_y);
-					if (e->detail == 1) {  // left button
-						pressed_idx = sector_index_from_point((int)count, app.width, app.height, e->event_x, e->event_y);
+					record_event("press %u %d %d", e->detail, e->event_x, e->event_y);
+					if (!menu_shown) break;  // marking mode decides on release
+					if (e->detail == 1 && app.compact && compact_outside(win_w, win_h, e->event_x, e->event_y)) {
+						DBG("[piewin] PRESS outside the compact disc -> CANCEL\n");
+						exit_code = 1;
+						running = 0;
+					} else if (e->detail == 1) {  // left button
+						pressed_idx = sector_index_from_point((int)count, app.rings, win_w, win_h, e->event_x, e->event_y);
 						DBG("[piewin] PRESS on idx=%d -> SELECT & EXIT NOW\n", pressed_idx);
 						if (pressed_idx >= 0 && pressed_idx < (int)count) {
-							if (type_mode) {
-								type_text = strdup(entries[pressed_idx].text);
-								DBG("[piewin] (type mode) storing text: \"%s\"\n", type_text);
-							} else {
-								fprintf(stdout, "%s\n", entries[pressed_idx].text);
-								fflush(stdout);
-								DBG("[piewin] SELECT idx=%d \"%s\"\n", pressed_idx, entries[pressed_idx].text);
-							}
+							select_entry(&entries[pressed_idx], type_mode || paste_mode, e->time, &type_text,
+							             &select_time);
 							exit_code = 0;
 							running = 0;
 						}
@@ -1213,7 +5702,21 @@ int main(int argc, char **argv)
 					xcb_button_release_event_t *e = (xcb_button_release_event_t *)ev;
 					DBG("[piewin] BUTTON_RELEASE detail=%u at %d,%d\n",
 					    e->detail, e->event_x, e->event_y);
+					record_event("release %u %d %d", e->detail, e->event_x, e->event_y);
 					pressed_idx = -1;
+					if (!menu_shown && e->detail == 1) {
+						// Stroke then release selects by direction; a click
+						// without a stroke asks for the menu instead.
+						int idx = mark_index((int)count, mark_ox, mark_oy, e->event_x, e->event_y);
+						if (idx < 0) {
+							dwell_deadline_ns = 0;
+							break;
+						}
+						DBG("[piewin] MARK release -> idx=%d\n", idx);
+						select_entry(&entries[idx], type_mode || paste_mode, e->time, &type_text, &select_time);
+						exit_code = 0;
+						running = 0;
+					}
 				}
 				break;
 
@@ -1226,6 +5729,7 @@ int main(int argc, char **argv)
 					xcb_key_press_event_t *e = (xcb_key_press_event_t *)ev;
 					xcb_keysym_t sym = xcb_key_symbols_get_keysym(app.keysyms, e->detail, 0);
 					DBG("[piewin] KEY_PRESS detail=%u sym=0x%08x\n", e->detail, (unsigned)sym);
+					record_event("key 0x%x", (unsigned)sym);
 
 					if (sym == XK_Escape || sym == 'q' || sym == 'Q') {
 						DBG("[piewin] Quit key pressed (sym=0x%08x)\n", (unsigned)sym);
@@ -1234,40 +5738,25 @@ int main(int argc, char **argv)
 						break;
 					}
 
-					// Initialize selection if needed
-					if (sel_idx < 0 && (int)count > 0) sel_idx = 0;
-
-					int moved = 0;
-					// Prev
-					if (sym == XK_Left || sym == XK_Up || sym == 'h' || sym == 'k' || sym == 'H' || sym == 'K') {
-						if ((int)count > 0) {
-							sel_idx = (sel_idx - 1 + (int)count) % (int)count;
-							moved = 1;
-						}
-					}
-					// Next
-					if (sym == XK_Right || sym == XK_Down || sym == 'l' || sym == 'j' || sym == 'L' || sym == 'J') {
-						if ((int)count > 0) {
-							sel_idx = (sel_idx + 1) % (int)count;
-							moved = 1;
-						}
+					// Keyboard navigation needs the menu on screen
+					if (!menu_shown) {
+						menu_shown = 1;
+						renderer_post(&app, sel_idx, input_ns);
 					}
-					if (moved) {
+
+					int prev_idx = sel_idx;
+					sel_idx = nav_apply(sym, sel_idx, (int)count);
+					if (sel_idx != prev_idx) {
 						DBG("[piewin] KEY NAV -> sel_idx=%d\n", sel_idx);
-						draw(&app, entries, (int)count, sel_idx);
+						renderer_post(&app, sel_idx, input_ns);
 					}
 
 					// Enter to select
 					if (sym == XK_Return || sym == XK_KP_Enter) {
 						if (sel_idx >= 0 && sel_idx < (int)count) {
-							if (type_mode) {
-								type_text = strdup(entries[sel_idx].text);
-								DBG("[piewin] (type mode) storing text: \"%s\"\n", type_text);
-							} else {
-								fprintf(stdout, "%s\n", entries[sel_idx].text);
-								fflush(stdout);
-								DBG("[piewin] ENTER -> SELECT idx=%d \"%s\"\n", sel_idx, entries[sel_idx].text);
-							}
+							DBG("[piewin] ENTER -> idx=%d\n", sel_idx);
+							select_entry(&entries[sel_idx], type_mode || paste_mode, e->time, &type_text,
+							             &select_time);
 							exit_code = 0;
 							running = 0;
 						}
@@ -1279,13 +5768,13 @@ int main(int argc, char **argv)
 				{
 					xcb_configure_notify_event_t *e = (xcb_configure_notify_event_t *)ev;
 					DBG("[piewin] CONFIGURE_NOTIFY w=%u h=%u (cur=%d,%d)\n",
-					    e->width, e->height, app.width, app.height);
-					if (e->width != app.width || e->height != app.height) {
-						app.width = e->width;
-						app.height = e->height;
-						DBG("[piewin] RESIZE -> %dx%d (recreate surfaces)\n", app.width, app.height);
-						recreate_cairo(&app);
-						draw(&app, entries, (int)count, sel_idx);
+					    e->width, e->height, win_w, win_h);
+					record_event("configure %u %u", e->width, e->height);
+					if (e->width != win_w || e->height != win_h) {
+						win_w = e->width;
+						win_h = e->height;
+						renderer_resize(&app, win_w, win_h, menu_shown);
+						mark_commit = (int)(MARK_COMMIT_FRAC * (win_w < win_h ? win_w : win_h));
 					}
 				}
 				break;
@@ -1314,11 +5803,26 @@ int main(int argc, char **argv)
 				}
 				break;
 
+			case XCB_MAPPING_NOTIFY:
+				{
+					xcb_mapping_notify_event_t *e = (xcb_mapping_notify_event_t *)ev;
+					DBG("[piewin] MAPPING_NOTIFY request=%u\n", e->request);
+					xcb_refresh_keyboard_mapping(app.keysyms, e);
+					keyidx_invalidate(&app.keyidx);
+				}
+				break;
+
 			default: break;
 		}
 		free(ev);
 	}
 
+	renderer_stop(&app);
+	if (app.stats.enabled) stats_report(&app);
+	record_close();
+
+	xstats_phase(conn, "teardown");
+
 	// Cleanup grabs first (so focus returns) and close the window
 	ungrab_input(&app);
 	if (app.win) xcb_destroy_window(conn, app.win);
@@ -1331,11 +5835,34 @@ int main(int argc, char **argv)
 		xcb_flush(conn);
 	}
 
-	// If in type mode, wait a bit for focus to settle then type
-	if (type_mode && type_text && exit_code == 0) {
-		DBG("[piewin] Sleeping %dms before typing...\n", TYPE_DELAY_MS);
-		sleep_ms(TYPE_DELAY_MS);
-		type_utf8_string(&app, type_text);
+	xcb_window_t prev_focus = XCB_NONE;
+	if (type_mode || paste_mode) {
+		xcb_get_input_focus_reply_t *fr = xstats_reply(xcb_get_input_focus_reply(conn, prev_focus_ck, NULL));
+		if (fr) {
+			prev_focus = fr->focus;
+			free(fr);
+		}
+		DBG("[piewin] Focus before mapping: 0x%08x\n", (unsigned)prev_focus);
+	}
+
+	// In type/paste mode, start as soon as focus is back where it was
+	if ((type_mode || paste_mode) && type_text && exit_code == 0) {
+		xstats_phase(conn, "focus-wait");
+		t = trace_begin();
+		wait_for_focus_return(&app, prev_focus, TYPE_FOCUS_TIMEOUT_MS);
+		trace_end("focus-wait", t);
+		xstats_phase(conn, paste_mode ? "paste" : "type");
+		t = trace_begin();
+		if (paste_mode) {
+			if (!paste_utf8_string(&app, type_text, paste_chord, select_time)) {
+				DBG("[piewin] Paste not served\n");
+				exit_code = 1;
+			}
+			trace_end("paste", t);
+		} else {
+			type_utf8_string(&app, type_text);
+			trace_end("type", t);
+		}
 	}
 
 	// Extra safety: release any possible stuck keys before exiting
@@ -1346,17 +5873,19 @@ int main(int argc, char **argv)
 	if (app.bufcr) cairo_destroy(app.bufcr);
 	if (app.bufsurf) cairo_surface_destroy(app.bufsurf);
 	if (app.bg_image) cairo_surface_destroy(app.bg_image);
+	if (app.bg_pixmap) xcb_free_pixmap(conn, app.bg_pixmap);
 
 	// type_text consumed; free after typing
 	free(type_text);
 
 	if (app.keysyms) xcb_key_symbols_free(app.keysyms);
+	keyidx_free(&app.keyidx);
+	xkbmap_free(&app.xkbmap);
 
+	xstats_phase(conn, NULL);
 	xcb_disconnect(conn);
 
-	for (size_t i = 0; i < count; ++i)
-		free(entries[i].text);
-	free(entries);
+	free_entries(entries, count);
 	if (lock_fd >= 0) {
 		DBG("[piewin] Releasing single-instance lock (fd=%d)\n", lock_fd);
 		close(lock_fd);